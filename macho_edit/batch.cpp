@@ -0,0 +1,385 @@
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "cpuinfo.h"
+#include "fileutils.h"
+#include "header_loader.h"
+#include "macros.h"
+
+#define HEADER_BATCH 256
+
+bool is_macho_file(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+
+	uint32_t header[2];
+	bool is_macho = pread_all(fd, header, sizeof(header), 0) && IS_MACHO(header[0], header[1]);
+
+	close(fd);
+
+	return is_macho;
+}
+
+// Collects every regular file below dir. Symlinks aren't followed so the
+// same binary isn't edited twice through a bundle's Versions/Current.
+static void walk(const std::string &dir, std::vector<std::string> &files) {
+	DIR *d = opendir(dir.c_str());
+	if(!d) {
+		return;
+	}
+
+	while(struct dirent *entry = readdir(d)) {
+		if(!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+			continue;
+		}
+
+		std::string path = dir + "/" + entry->d_name;
+
+		unsigned char type = entry->d_type;
+		if(type == DT_UNKNOWN) {
+			struct stat s;
+			if(lstat(path.c_str(), &s) != 0) {
+				continue;
+			}
+			type = S_ISDIR(s.st_mode)? DT_DIR: S_ISREG(s.st_mode)? DT_REG: DT_LNK;
+		}
+
+		if(type == DT_DIR) {
+			walk(path, files);
+		} else if(type == DT_REG) {
+			files.push_back(path);
+		}
+	}
+
+	closedir(d);
+}
+
+// Directories are replaced by the files below them, which are sniffed
+static void expand_paths(const std::vector<std::string> &paths, std::vector<std::string> &files, std::vector<bool> &sniff) {
+	for(auto &path : paths) {
+		struct stat s;
+		if(stat(path.c_str(), &s) == 0 && S_ISDIR(s.st_mode)) {
+			std::vector<std::string> found;
+			walk(path, found);
+
+			files.insert(files.end(), found.begin(), found.end());
+			sniff.insert(sniff.end(), found.size(), true);
+		} else {
+			files.push_back(path);
+			sniff.push_back(false);
+		}
+	}
+}
+
+// Runs the commands on every binary, with directories searched for binaries.
+// Workers take the next unclaimed files until none are left, and the output
+// of each file is printed in order once all of them are done. Commands that
+// only look at the headers get them from a HeaderLoader, HEADER_BATCH files at
+// a time.
+bool run_batch(const std::vector<Command> &commands, const std::vector<std::string> &paths, unsigned int n_threads, ParseCache *cache) {
+	std::vector<std::string> files;
+	std::vector<bool> sniff;
+	expand_paths(paths, files, sniff);
+
+	size_t n_files = files.size();
+
+	// Not a vector<bool>, every worker writes its own elements
+	std::vector<uint8_t> results(n_files);
+	std::vector<std::string> outputs(n_files);
+
+	enum { SKIPPED, DONE, FAILED };
+
+	bool read_only = commands_read_only(commands);
+	bool headers_only = commands_headers_only(commands);
+	size_t step = headers_only? HEADER_BATCH: 1;
+
+	// Threads the workers leave over go to the archs of each binary
+	unsigned int arch_threads = 1;
+
+	auto load_batch = [&](size_t first, size_t last) {
+		std::vector<std::string> batch(files.begin() + first, files.begin() + last);
+
+		HeaderLoader loader(step, cache);
+		loader.load(batch, [&](size_t index, MachO *macho, const std::string &error) {
+			size_t i = first + index;
+
+			std::ostringstream o;
+			if(macho) {
+				macho->n_threads = arch_threads;
+				results[i] = apply_commands(commands, *macho, o)? DONE: FAILED;
+			} else if(error.empty() && sniff[i]) {
+				results[i] = SKIPPED;
+			} else {
+				o << files[i] << ": " << (error.empty()? "Not a mach-o binary!": error) << "\n";
+				results[i] = FAILED;
+			}
+			outputs[i] = o.str();
+		});
+	};
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		size_t first;
+		while((first = next.fetch_add(step)) < n_files) {
+			if(headers_only) {
+				load_batch(first, MIN(first + step, n_files));
+				continue;
+			}
+
+			// Files found in directories that aren't mach-o are left alone
+			size_t i = first;
+			if(sniff[i] && !is_macho_file(files[i].c_str())) {
+				results[i] = SKIPPED;
+				continue;
+			}
+
+			// The edit may keep the inode, size and even the mtime
+			if(cache && !read_only) {
+				cache->erase(files[i]);
+			}
+
+			std::ostringstream o;
+			results[i] = run_commands(commands, files[i], o, arch_threads)? DONE: FAILED;
+			outputs[i] = o.str();
+		}
+	};
+
+	unsigned int n_jobs = n_threads;
+	if(n_threads > n_files) {
+		n_threads = (unsigned int)n_files;
+	}
+	if(n_threads == 0) {
+		n_threads = 1;
+	}
+	arch_threads = MAX(1u, n_jobs / n_threads);
+
+	std::vector<std::thread> threads;
+	for(unsigned int i = 1; i < n_threads; i++) {
+		threads.push_back(std::thread(worker));
+	}
+	worker();
+
+	for(auto &thread : threads) {
+		thread.join();
+	}
+
+	size_t n_done = 0;
+	size_t n_failed = 0;
+	for(size_t i = 0; i < n_files; i++) {
+		std::cout << outputs[i];
+
+		n_done += results[i] == DONE;
+		n_failed += results[i] == FAILED;
+	}
+
+	if(n_files > 1) {
+		std::cout << n_done << " binaries " << (read_only? "read": "edited") << ", " << n_failed << " failed.\n";
+	}
+
+	if(cache) {
+		std::cout << "Cache: " << cache->hits << " hits, " << cache->misses << " misses.\n";
+	}
+
+	return n_failed == 0;
+}
+
+// Reads the headers of every binary in paths on n_threads threads, calling
+// read for each file from whichever thread loaded it. If macho is NULL error
+// says why, or is empty for files found in directories that aren't mach-o
+// binaries. Returns the number of files.
+size_t read_binaries(const std::vector<std::string> &paths, unsigned int n_threads, ParseCache *cache, std::function<void(size_t index, const std::string &file, MachO *macho, const std::string &error)> read) {
+	std::vector<std::string> files;
+	std::vector<bool> sniff;
+	expand_paths(paths, files, sniff);
+
+	size_t n_files = files.size();
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		size_t first;
+		while((first = next.fetch_add(HEADER_BATCH)) < n_files) {
+			size_t last = MIN(first + HEADER_BATCH, n_files);
+			std::vector<std::string> batch(files.begin() + first, files.begin() + last);
+
+			HeaderLoader loader(HEADER_BATCH, cache);
+			loader.load(batch, [&](size_t index, MachO *macho, const std::string &error) {
+				size_t i = first + index;
+				if(!macho && error.empty() && !sniff[i]) {
+					read(i, files[i], NULL, "Not a mach-o binary!");
+				} else {
+					read(i, files[i], macho, error);
+				}
+			});
+		}
+	};
+
+	n_threads = (unsigned int)MAX((size_t)1, MIN((size_t)n_threads, (n_files + HEADER_BATCH - 1) / HEADER_BATCH));
+
+	std::vector<std::thread> threads;
+	for(unsigned int i = 1; i < n_threads; i++) {
+		threads.push_back(std::thread(worker));
+	}
+	worker();
+
+	for(auto &thread : threads) {
+		thread.join();
+	}
+
+	return n_files;
+}
+
+// Drops the entries of the given files and of everything below the given
+// directories, or the whole cache without any paths
+void invalidate_cache(ParseCache &cache, const std::vector<std::string> &paths) {
+	if(paths.empty()) {
+		cache.clear();
+		return;
+	}
+
+	for(auto &path : paths) {
+		struct stat s;
+		if(stat(path.c_str(), &s) == 0 && S_ISDIR(s.st_mode)) {
+			std::vector<std::string> found;
+			walk(path, found);
+
+			for(auto &file : found) {
+				cache.erase(file);
+			}
+		} else {
+			cache.erase(path);
+		}
+	}
+}
+
+// Like lipo -create: every arch of the inputs goes into a new fat binary,
+// each slice copied once straight from its input
+bool create_fat(const std::string &output, const std::vector<std::string> &inputs) {
+	std::string path = output;
+
+	try {
+		std::vector<MachO> machos;
+		for(auto &input : inputs) {
+			path = input;
+			machos.push_back(MachO(input.c_str(), false, true));
+		}
+
+		path = output;
+
+		MachO fat(output.c_str(), machos);
+		if(!fat.rewrite()) {
+			throw "Couldn't write binary!";
+		}
+	} catch(const std::string &err) {
+		std::cout << path << ": " << err << "\n";
+		return false;
+	} catch(const char *err) {
+		std::cout << path << ": " << err << "\n";
+		return false;
+	}
+
+	return true;
+}
+
+// Writes every arch of every binary next to it as <path>.<arch>. Binaries are
+// spread over n_threads workers, and the archs of each over the threads the
+// workers leave over.
+bool explode_binaries(const std::vector<std::string> &paths, unsigned int n_threads) {
+	std::vector<std::string> files;
+	std::vector<bool> sniff;
+	expand_paths(paths, files, sniff);
+
+	size_t n_files = files.size();
+
+	std::vector<uint8_t> results(n_files);
+	std::vector<std::string> outputs(n_files);
+
+	enum { SKIPPED, DONE, FAILED };
+
+	// Threads the workers leave over go to the archs of each binary
+	unsigned int arch_threads = 1;
+
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		size_t i;
+		while((i = next.fetch_add(1)) < n_files) {
+			if(sniff[i] && !is_macho_file(files[i].c_str())) {
+				results[i] = SKIPPED;
+				continue;
+			}
+
+			std::ostringstream o;
+			try {
+				MachO macho(files[i].c_str(), false, true);
+				macho.n_threads = arch_threads;
+
+				std::vector<std::string> names;
+				for(auto &arch : macho.archs) {
+					std::string name = files[i] + "." + cpu_name(arch.fat_arch.cputype, arch.fat_arch.cpusubtype);
+					if(std::find(names.begin(), names.end(), name) != names.end()) {
+						name += "." + std::to_string(names.size());
+					}
+					names.push_back(name);
+				}
+
+				std::vector<bool> saved = macho.save_archs_to_files(names);
+
+				results[i] = DONE;
+				for(size_t j = 0; j < saved.size(); j++) {
+					if(!saved[j]) {
+						o << names[j] << ": Couldn't write arch!\n";
+						results[i] = FAILED;
+					}
+				}
+			} catch(const std::string &err) {
+				o << files[i] << ": " << err << "\n";
+				results[i] = FAILED;
+			} catch(const char *err) {
+				o << files[i] << ": " << err << "\n";
+				results[i] = FAILED;
+			}
+			outputs[i] = o.str();
+		}
+	};
+
+	unsigned int n_jobs = n_threads;
+	n_threads = (unsigned int)MAX((size_t)1, MIN((size_t)n_threads, n_files));
+	arch_threads = MAX(1u, n_jobs / n_threads);
+
+	std::vector<std::thread> threads;
+	for(unsigned int i = 1; i < n_threads; i++) {
+		threads.push_back(std::thread(worker));
+	}
+	worker();
+
+	for(auto &thread : threads) {
+		thread.join();
+	}
+
+	size_t n_done = 0;
+	size_t n_failed = 0;
+	for(size_t i = 0; i < n_files; i++) {
+		std::cout << outputs[i];
+
+		n_done += results[i] == DONE;
+		n_failed += results[i] == FAILED;
+	}
+
+	if(n_files > 1) {
+		std::cout << n_done << " binaries exploded, " << n_failed << " failed.\n";
+	}
+
+	return n_failed == 0;
+}
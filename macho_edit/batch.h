@@ -0,0 +1,17 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "commands.h"
+#include "parse_cache.h"
+
+bool is_macho_file(const char *path);
+
+bool run_batch(const std::vector<Command> &commands, const std::vector<std::string> &paths, unsigned int n_threads, ParseCache *cache = NULL);
+size_t read_binaries(const std::vector<std::string> &paths, unsigned int n_threads, ParseCache *cache, std::function<void(size_t index, const std::string &file, MachO *macho, const std::string &error)> read);
+void invalidate_cache(ParseCache &cache, const std::vector<std::string> &paths);
+
+bool create_fat(const std::string &output, const std::vector<std::string> &inputs);
+bool explode_binaries(const std::vector<std::string> &paths, unsigned int n_threads);
@@ -0,0 +1,498 @@
+#include <exception>
+#include <thread>
+
+#include <mach-o/loader.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chained_fixups.h"
+#include "macros.h"
+
+// Bytes between the pointers of a chain, per unit of next
+static uint32_t pointer_stride(uint16_t pointer_format) {
+	switch(pointer_format) {
+		case DYLD_CHAINED_PTR_ARM64E:
+		case DYLD_CHAINED_PTR_ARM64E_USERLAND:
+		case DYLD_CHAINED_PTR_ARM64E_USERLAND24:
+			return 8;
+		case DYLD_CHAINED_PTR_64:
+		case DYLD_CHAINED_PTR_64_OFFSET:
+		case DYLD_CHAINED_PTR_32:
+			return 4;
+		default:
+			return 0;
+	}
+}
+
+static int64_t sign_extend(uint64_t value, unsigned int bits) {
+	return (int64_t)(value << (64 - bits)) >> (64 - bits);
+}
+
+ChainedFixups::ChainedFixups(const MachO &macho, uint32_t arch_index) {
+	const MachOArch &arch = macho.archs[arch_index];
+	arch_magic = arch.mach_header.magic;
+
+	const linkedit_data_command *fixups_cmd = NULL;
+	for(auto &lc : arch.load_commands) {
+		if(lc.cmd == LC_DYLD_CHAINED_FIXUPS && lc.cmdsize >= sizeof(linkedit_data_command)) {
+			fixups_cmd = (const linkedit_data_command *)lc.raw_lc;
+		}
+	}
+
+	libraries = arch.dylib_paths();
+
+	if(!fixups_cmd) {
+		throw "No LC_DYLD_CHAINED_FIXUPS!";
+	}
+
+	image_size = arch.fat_arch.size;
+	image = macho.arch_data(arch_index, 0, image_size, storage);
+	if(!image) {
+		throw "Couldn't read arch!";
+	}
+
+	uint32_t offset = SWAP32(fixups_cmd->dataoff, arch_magic);
+	size = SWAP32(fixups_cmd->datasize, arch_magic);
+	if((uint64_t)offset + size > image_size || size < sizeof(dyld_chained_fixups_header)) {
+		throw "Chained fixups extend past end of arch!";
+	}
+
+	data = image + offset;
+
+	dyld_chained_fixups_header header;
+	memcpy(&header, data, sizeof(header));
+	if(header.fixups_version != 0) {
+		throw "Unknown chained fixups version!";
+	}
+
+	read_imports(header);
+	read_segments(arch, header);
+}
+
+void ChainedFixups::read_imports(const dyld_chained_fixups_header &header) {
+	imports_offset = header.imports_offset;
+	imports_format = header.imports_format;
+
+	if(header.symbols_format != 0) {
+		throw "Compressed chained fixup symbols aren't supported!";
+	}
+
+	size_t import_size;
+	switch(imports_format) {
+		case DYLD_CHAINED_IMPORT:
+			import_size = sizeof(dyld_chained_import);
+			break;
+		case DYLD_CHAINED_IMPORT_ADDEND:
+			import_size = sizeof(dyld_chained_import_addend);
+			break;
+		case DYLD_CHAINED_IMPORT_ADDEND64:
+			import_size = sizeof(dyld_chained_import_addend64);
+			break;
+		default:
+			throw "Unknown chained import format!";
+	}
+
+	if((uint64_t)imports_offset + (uint64_t)header.imports_count * import_size > size || header.symbols_offset > size) {
+		throw "Chained imports extend past end of fixups!";
+	}
+
+	const char *symbols = (const char *)data + header.symbols_offset;
+	size_t symbols_size = size - header.symbols_offset;
+
+	imports.resize(header.imports_count);
+	for(uint32_t i = 0; i < header.imports_count; i++) {
+		const uint8_t *p = data + imports_offset + i * import_size;
+		chained_import &import = imports[i];
+
+		uint32_t name_offset;
+		if(imports_format == DYLD_CHAINED_IMPORT_ADDEND64) {
+			dyld_chained_import_addend64 raw;
+			memcpy(&raw, p, sizeof(raw));
+
+			import.lib_ordinal = raw.lib_ordinal > 0xfff0? (int16_t)raw.lib_ordinal: (int32_t)raw.lib_ordinal;
+			import.weak = raw.weak_import;
+			import.addend = (int64_t)raw.addend;
+			name_offset = raw.name_offset;
+		} else {
+			dyld_chained_import_addend raw;
+			memcpy(&raw, p, import_size);
+
+			import.lib_ordinal = raw.lib_ordinal > 0xf0? (int8_t)raw.lib_ordinal: (int32_t)raw.lib_ordinal;
+			import.weak = raw.weak_import;
+			import.addend = imports_format == DYLD_CHAINED_IMPORT_ADDEND? raw.addend: 0;
+			name_offset = raw.name_offset;
+		}
+
+		if(name_offset >= symbols_size || !memchr(symbols + name_offset, '\0', symbols_size - name_offset)) {
+			throw "Chained import name extends past end of fixups!";
+		}
+		import.name = symbols + name_offset;
+	}
+}
+
+// The starts in the image list the segments in the order of their commands
+void ChainedFixups::read_segments(const MachOArch &arch, const dyld_chained_fixups_header &header) {
+	for(auto &lc : arch.load_commands) {
+		chained_segment segment;
+		uint64_t vmaddr;
+
+		if((lc.cmd == LC_SEGMENT_64 && lc.cmdsize < sizeof(segment_command_64)) || (lc.cmd == LC_SEGMENT && lc.cmdsize < sizeof(segment_command))) {
+			// Skipping it would give the segments after it the wrong starts
+			throw "Segment command too small!";
+		}
+
+		if(lc.cmd == LC_SEGMENT_64) {
+			auto *c = (const segment_command_64 *)lc.raw_lc;
+			segment.fileoff = SWAP64(c->fileoff, arch_magic);
+			segment.filesize = SWAP64(c->filesize, arch_magic);
+			vmaddr = SWAP64(c->vmaddr, arch_magic);
+		} else if(lc.cmd == LC_SEGMENT) {
+			auto *c = (const segment_command *)lc.raw_lc;
+			segment.fileoff = SWAP32(c->fileoff, arch_magic);
+			segment.filesize = SWAP32(c->filesize, arch_magic);
+			vmaddr = SWAP32(c->vmaddr, arch_magic);
+		} else {
+			continue;
+		}
+
+		if(segment.fileoff == 0 && segment.filesize != 0) {
+			base = vmaddr;
+		}
+
+		segment.starts = 0;
+		segments.push_back(segment);
+	}
+
+	uint32_t seg_count;
+	if(header.starts_offset > size - sizeof(seg_count)) {
+		throw "Chained starts extend past end of fixups!";
+	}
+	memcpy(&seg_count, data + header.starts_offset, sizeof(seg_count));
+
+	if((uint64_t)header.starts_offset + sizeof(seg_count) + (uint64_t)seg_count * sizeof(uint32_t) > size) {
+		throw "Chained starts extend past end of fixups!";
+	}
+	if(seg_count > segments.size()) {
+		throw "Chained starts for more segments than there are!";
+	}
+
+	for(uint32_t i = 0; i < seg_count; i++) {
+		uint32_t info_offset;
+		memcpy(&info_offset, data + header.starts_offset + sizeof(seg_count) + i * sizeof(uint32_t), sizeof(info_offset));
+		if(info_offset == 0) {
+			continue;
+		}
+
+		chained_segment &segment = segments[i];
+		segment.starts = header.starts_offset + info_offset;
+
+		auto *starts = segment_starts(i);
+		if((uint64_t)segment.starts + offsetof(dyld_chained_starts_in_segment, page_start) > size
+			|| starts->size > size - segment.starts
+			|| starts->size < offsetof(dyld_chained_starts_in_segment, page_start) + starts->page_count * sizeof(uint16_t)) {
+			throw "Chained starts extend past end of fixups!";
+		}
+
+		if(pointer_stride(starts->pointer_format) == 0) {
+			throw "Unsupported chained pointer format!";
+		}
+		if(starts->page_size == 0 || segment.fileoff + segment.filesize > image_size) {
+			throw "Malformed chained fixups!";
+		}
+	}
+}
+
+const dyld_chained_starts_in_segment *ChainedFixups::segment_starts(uint32_t segment) const {
+	return (const dyld_chained_starts_in_segment *)(data + segments[segment].starts);
+}
+
+// Follows one chain, which never leaves its page
+void ChainedFixups::walk_chain(uint32_t segment, uint32_t page, uint16_t start, std::vector<chained_fixup> &fixups) const {
+	const chained_segment &seg = segments[segment];
+	auto *starts = segment_starts(segment);
+
+	uint16_t format = starts->pointer_format;
+	uint32_t stride = pointer_stride(format);
+	size_t pointer_size = format == DYLD_CHAINED_PTR_32? sizeof(uint32_t): sizeof(uint64_t);
+
+	uint64_t page_offset = (uint64_t)page * starts->page_size;
+	uint64_t page_end = MIN(page_offset + starts->page_size, seg.filesize);
+
+	for(uint64_t offset = page_offset + start;;) {
+		if(offset + pointer_size > page_end) {
+			throw "Chained fixup extends past its page!";
+		}
+
+		const uint8_t *p = image + seg.fileoff + offset;
+
+		chained_fixup fixup;
+		memset(&fixup, 0, sizeof(fixup));
+		fixup.offset = starts->segment_offset + offset;
+
+		uint32_t ordinal = 0;
+		uint64_t next;
+		bool pointer = true;
+
+		switch(format) {
+			case DYLD_CHAINED_PTR_ARM64E:
+			case DYLD_CHAINED_PTR_ARM64E_USERLAND:
+			case DYLD_CHAINED_PTR_ARM64E_USERLAND24: {
+				dyld_chained_ptr_arm64e_rebase rebase;
+				memcpy(&rebase, p, sizeof(rebase));
+
+				next = rebase.next;
+				fixup.bind = rebase.bind;
+				fixup.auth = rebase.auth;
+
+				if(fixup.auth) {
+					dyld_chained_ptr_arm64e_auth_rebase auth;
+					memcpy(&auth, p, sizeof(auth));
+
+					fixup.key = auth.key;
+					fixup.addr_div = auth.addrDiv;
+					fixup.diversity = auth.diversity;
+				}
+
+				if(fixup.bind && format == DYLD_CHAINED_PTR_ARM64E_USERLAND24) {
+					dyld_chained_ptr_arm64e_bind24 bind;
+					memcpy(&bind, p, sizeof(bind));
+
+					ordinal = bind.ordinal;
+					fixup.addend = fixup.auth? 0: sign_extend(bind.addend, 19);
+				} else if(fixup.bind) {
+					dyld_chained_ptr_arm64e_bind bind;
+					memcpy(&bind, p, sizeof(bind));
+
+					ordinal = bind.ordinal;
+					fixup.addend = fixup.auth? 0: sign_extend(bind.addend, 19);
+				} else if(fixup.auth) {
+					dyld_chained_ptr_arm64e_auth_rebase auth;
+					memcpy(&auth, p, sizeof(auth));
+
+					fixup.target = auth.target;
+				} else {
+					fixup.target = rebase.target;
+					fixup.high8 = rebase.high8;
+
+					// Only plain arm64e has addresses instead of offsets
+					if(format == DYLD_CHAINED_PTR_ARM64E) {
+						fixup.target -= base;
+					}
+				}
+				break;
+			}
+			case DYLD_CHAINED_PTR_64:
+			case DYLD_CHAINED_PTR_64_OFFSET: {
+				dyld_chained_ptr_64_rebase rebase;
+				memcpy(&rebase, p, sizeof(rebase));
+
+				next = rebase.next;
+				fixup.bind = rebase.bind;
+
+				if(fixup.bind) {
+					dyld_chained_ptr_64_bind bind;
+					memcpy(&bind, p, sizeof(bind));
+
+					ordinal = bind.ordinal;
+					fixup.addend = bind.addend;
+				} else {
+					fixup.target = rebase.target;
+					fixup.high8 = rebase.high8;
+
+					if(format == DYLD_CHAINED_PTR_64) {
+						fixup.target -= base;
+					}
+				}
+				break;
+			}
+			default: {
+				dyld_chained_ptr_32_rebase rebase;
+				memcpy(&rebase, p, sizeof(rebase));
+
+				next = rebase.next;
+				fixup.bind = rebase.bind;
+
+				if(fixup.bind) {
+					dyld_chained_ptr_32_bind bind;
+					memcpy(&bind, p, sizeof(bind));
+
+					ordinal = bind.ordinal;
+					fixup.addend = bind.addend;
+				} else if(rebase.target > starts->max_valid_pointer) {
+					// An int that happens to be in the chain, not a pointer
+					pointer = false;
+				} else {
+					fixup.target = rebase.target - base;
+				}
+				break;
+			}
+		}
+
+		if(fixup.bind) {
+			if(ordinal >= imports.size()) {
+				throw "Chained fixup binds to a missing import!";
+			}
+			fixup.import = ordinal;
+		}
+
+		if(pointer) {
+			fixups.push_back(fixup);
+		}
+
+		if(next == 0) {
+			break;
+		}
+		offset += next * stride;
+	}
+}
+
+void ChainedFixups::walk_page(uint32_t segment, uint32_t page, std::vector<chained_fixup> &fixups) const {
+	auto *starts = segment_starts(segment);
+
+	uint16_t start = starts->page_start[page];
+	if(start == DYLD_CHAINED_PTR_START_NONE) {
+		return;
+	}
+
+	// 32 bit pages can have several chains, their starts follow the pages'
+	if(starts->pointer_format == DYLD_CHAINED_PTR_32 && (start & DYLD_CHAINED_PTR_START_MULTI)) {
+		uint32_t n_starts = (starts->size - offsetof(dyld_chained_starts_in_segment, page_start)) / sizeof(uint16_t);
+
+		for(uint32_t i = start & ~DYLD_CHAINED_PTR_START_MULTI; i < n_starts; i++) {
+			uint16_t chain_start = starts->page_start[i];
+			walk_chain(segment, page, chain_start & ~DYLD_CHAINED_PTR_START_LAST, fixups);
+
+			if(chain_start & DYLD_CHAINED_PTR_START_LAST) {
+				break;
+			}
+		}
+	} else {
+		walk_chain(segment, page, start, fixups);
+	}
+}
+
+// Every thread walks a run of consecutive pages, so putting their results
+// one after the other keeps the fixups in address order
+std::vector<chained_fixup> ChainedFixups::walk(unsigned int n_threads) const {
+	std::vector<std::pair<uint32_t, uint32_t>> pages;
+	for(uint32_t i = 0; i < segments.size(); i++) {
+		if(segments[i].starts == 0) {
+			continue;
+		}
+
+		auto *starts = segment_starts(i);
+		for(uint32_t page = 0; page < starts->page_count; page++) {
+			if(starts->page_start[page] != DYLD_CHAINED_PTR_START_NONE) {
+				pages.push_back(std::make_pair(i, page));
+			}
+		}
+	}
+
+	n_threads = (unsigned int)MAX(1, MIN(n_threads, pages.size()));
+
+	std::vector<std::vector<chained_fixup>> results(n_threads);
+	std::vector<std::exception_ptr> errors(n_threads);
+
+	auto worker = [&](unsigned int i) {
+		size_t first = pages.size() * i / n_threads;
+		size_t last = pages.size() * (i + 1) / n_threads;
+
+		try {
+			for(size_t j = first; j < last; j++) {
+				walk_page(pages[j].first, pages[j].second, results[i]);
+			}
+		} catch(...) {
+			errors[i] = std::current_exception();
+		}
+	};
+
+	// The calling thread walks the first share
+	std::vector<std::thread> threads;
+	for(unsigned int i = 1; i < n_threads; i++) {
+		threads.push_back(std::thread(worker, i));
+	}
+	worker(0);
+
+	for(auto &thread : threads) {
+		thread.join();
+	}
+
+	size_t n_fixups = 0;
+	for(unsigned int i = 0; i < n_threads; i++) {
+		if(errors[i]) {
+			std::rethrow_exception(errors[i]);
+		}
+		n_fixups += results[i].size();
+	}
+
+	std::vector<chained_fixup> fixups;
+	fixups.reserve(n_fixups);
+	for(auto &result : results) {
+		fixups.insert(fixups.end(), result.begin(), result.end());
+	}
+
+	return fixups;
+}
+
+// Like dyld_info -fixups: address of the pointer, then what it points to
+void ChainedFixups::print(const std::vector<chained_fixup> &fixups, std::ostream &out) const {
+	static const char *keys[] = {"IA", "IB", "DA", "DB"};
+
+	std::vector<std::string> import_libraries;
+	for(auto &import : imports) {
+		import_libraries.push_back(library_name(libraries, import.lib_ordinal));
+	}
+
+	std::string buf;
+	char line[128];
+
+	size_t n_binds = 0;
+	for(auto &fixup : fixups) {
+		snprintf(line, sizeof(line), "0x%016llx ", (unsigned long long)(base + fixup.offset));
+		buf += line;
+
+		if(fixup.bind) {
+			const chained_import &import = imports[fixup.import];
+
+			buf += "bind   ";
+			buf += import_libraries[fixup.import];
+			buf += " ";
+			buf += import.name;
+
+			int64_t addend = import.addend + fixup.addend;
+			if(addend) {
+				snprintf(line, sizeof(line), " %c 0x%llx", addend < 0? '-': '+', addend < 0? 0 - (unsigned long long)addend: (unsigned long long)addend);
+				buf += line;
+			}
+			if(import.weak) {
+				buf += " [weak]";
+			}
+
+			n_binds++;
+		} else {
+			snprintf(line, sizeof(line), "rebase 0x%llx", (unsigned long long)(base + fixup.target));
+			buf += line;
+
+			if(fixup.high8) {
+				snprintf(line, sizeof(line), " [high8 0x%x]", fixup.high8);
+				buf += line;
+			}
+		}
+
+		if(fixup.auth) {
+			snprintf(line, sizeof(line), " [auth %s 0x%04x%s]", keys[fixup.key & 3], fixup.diversity, fixup.addr_div? " addr": "");
+			buf += line;
+		}
+
+		buf += '\n';
+
+		if(buf.size() > 0x10000) {
+			out << buf;
+			buf.clear();
+		}
+	}
+
+	out << buf;
+	out << fixups.size() - n_binds << " rebases, " << n_binds << " binds, " << imports.size() << " imports.\n";
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <mach-o/fixup-chains.h>
+#include <stdint.h>
+
+#include "macho.h"
+
+// BIND_SPECIAL_DYLIB_* are the ordinals below 1
+struct chained_import {
+	const char *name;
+	int32_t lib_ordinal;
+	bool weak;
+	int64_t addend;
+};
+
+// A pointer dyld fixes up. Offsets are from the start of the image in
+// memory, whatever the pointer format stores.
+struct chained_fixup {
+	uint64_t offset;
+	bool bind;
+
+	// The import of a bind, the target of a rebase
+	uint32_t import;
+	uint64_t target;
+	int64_t addend;
+
+	uint8_t high8;
+
+	// arm64e pointer authentication
+	bool auth;
+	uint8_t key;
+	bool addr_div;
+	uint16_t diversity;
+};
+
+struct chained_segment {
+	uint64_t fileoff;
+	uint64_t filesize;
+
+	// Offset of the segment's dyld_chained_starts_in_segment in the fixups, 0
+	// if it has none
+	uint32_t starts;
+};
+
+// The LC_DYLD_CHAINED_FIXUPS of an arch: the imports binds refer to, and for
+// every page of every segment where the chain of pointers to fix up starts.
+// Pages are independent of each other, so walk() spreads them across
+// threads.
+class ChainedFixups {
+public:
+// Fields
+	uint32_t arch_magic;
+
+	// The whole slice and the fixups in it
+	const uint8_t *image = NULL;
+	uint64_t image_size = 0;
+	std::shared_ptr<const void> storage;
+
+	const uint8_t *data = NULL;
+	uint32_t size = 0;
+
+	// vmaddr of the mach header
+	uint64_t base = 0;
+
+	std::vector<chained_segment> segments;
+
+	// Where the imports are in the fixups and how they're stored, for
+	// rewriting their ordinals
+	uint32_t imports_offset = 0;
+	uint32_t imports_format = 0;
+	std::vector<chained_import> imports;
+
+	std::vector<std::string> libraries;
+
+// Methods
+	ChainedFixups(const MachO &macho, uint32_t arch_index);
+
+	void read_imports(const dyld_chained_fixups_header &header);
+	void read_segments(const MachOArch &arch, const dyld_chained_fixups_header &header);
+
+	const dyld_chained_starts_in_segment *segment_starts(uint32_t segment) const;
+	void walk_chain(uint32_t segment, uint32_t page, uint16_t start, std::vector<chained_fixup> &fixups) const;
+	void walk_page(uint32_t segment, uint32_t page, std::vector<chained_fixup> &fixups) const;
+	std::vector<chained_fixup> walk(unsigned int n_threads) const;
+
+	void print(const std::vector<chained_fixup> &fixups, std::ostream &out) const;
+};
@@ -0,0 +1,506 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "chained_fixups.h"
+#include "commands.h"
+#include "cpuinfo.h"
+#include "dyld_info.h"
+#include "export_trie.h"
+#include "macros.h"
+#include "magicnames.h"
+#include "symbol_index.h"
+#include "symbol_table.h"
+
+#define PATH_PADDING 8
+
+typedef void (*apply_func)(MachO &macho, const std::vector<std::string> &args, std::ostream &out);
+
+struct command_info {
+	const char *name;
+	const char *args;
+	size_t n_args;
+	bool read_only;
+	bool headers_only;
+	// Output that spans lines is headed by the binary's path
+	bool prints_path;
+	apply_func apply;
+	const char *description;
+};
+
+static std::vector<uint32_t> find_archs(const MachO &macho, const std::string &name) {
+	std::vector<uint32_t> indices;
+	for(uint32_t i = 0; i < macho.n_archs; i++) {
+		const fat_arch_64 &fat_arch = macho.archs[i].fat_arch;
+		if(cpu_name(fat_arch.cputype, fat_arch.cpusubtype & ~CPU_SUBTYPE_MASK) == name) {
+			indices.push_back(i);
+		}
+	}
+	return indices;
+}
+
+// Accepts both "LC_RPATH" and "rpath"
+uint32_t parse_cmd(const std::string &name) {
+	std::string full = name;
+	if(full.compare(0, 3, "LC_") != 0) {
+		full = "LC_" + full;
+	}
+
+	for(auto &c : full) {
+		c = c == '-'? '_': toupper(c);
+	}
+
+	for(uint32_t cmd = 1; cmd < 0x100; cmd++) {
+		if(cmd_name(cmd) == full) {
+			return cmd;
+		}
+		if(cmd_name(cmd | LC_REQ_DYLD) == full) {
+			return cmd | LC_REQ_DYLD;
+		}
+	}
+
+	throw "Unknown load command: " + name;
+}
+
+load_command *create_path_cmd(uint32_t cmd, uint32_t magic, const std::string &path) {
+	size_t header_size;
+	switch(cmd) {
+		case LC_ID_DYLIB:
+		case LC_LOAD_DYLIB:
+		case LC_LOAD_WEAK_DYLIB:
+		case LC_REEXPORT_DYLIB:
+		case LC_LAZY_LOAD_DYLIB:
+		case LC_LOAD_UPWARD_DYLIB:
+			header_size = sizeof(dylib_command);
+			break;
+		case LC_RPATH:
+			header_size = sizeof(rpath_command);
+			break;
+		case LC_ID_DYLINKER:
+		case LC_LOAD_DYLINKER:
+			header_size = sizeof(dylinker_command);
+			break;
+		default:
+			return NULL;
+	}
+
+	uint32_t path_size = (uint32_t)ROUND_UP(path.length() + 1, PATH_PADDING);
+	uint32_t cmdsize = (uint32_t)header_size + path_size;
+
+	load_command *lc = (load_command *)calloc(1, cmdsize);
+	memcpy(((uint8_t *)lc) + header_size, path.c_str(), path.length());
+
+	lc->cmd = SWAP32(cmd, magic);
+	lc->cmdsize = SWAP32(cmdsize, magic);
+
+	// The string offset is the first field after cmd and cmdsize in all of them
+	auto *c = (dylib_command *)lc;
+	c->dylib.name.offset = SWAP32((uint32_t)header_size, magic);
+
+	return lc;
+}
+
+static void apply_list(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	for(auto &arch : macho.archs) {
+		out << arch.description() << ":\n";
+
+		for(auto &lc : arch.load_commands) {
+			out << "\t" << lc.description() << "\n";
+		}
+	}
+}
+
+// One line per load command, made to be grepped or loaded into a database
+static void apply_inventory(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	for(auto &arch : macho.archs) {
+		const fat_arch_64 &fat_arch = arch.fat_arch;
+		std::string name = cpu_name(fat_arch.cputype, fat_arch.cpusubtype & ~CPU_SUBTYPE_MASK);
+
+		for(auto &lc : arch.load_commands) {
+			// Strings in load commands are padded with NULs
+			std::string description = lc.description().c_str();
+
+			out << macho.filename << "\t" << name << "\t0x" << std::hex << fat_arch.offset << std::dec << "\t" << description << "\n";
+		}
+	}
+}
+
+static void apply_symbols(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	for(uint32_t i = 0; i < macho.n_archs; i++) {
+		out << macho.archs[i].description() << ":\n";
+
+		SymbolTable symbols(macho, i);
+		symbols.index_names();
+		symbols.print(out);
+	}
+}
+
+static void apply_index_symbols(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	macho.index_symbols();
+	if(!macho.save_symbol_index()) {
+		throw "Couldn't write " + macho.symbol_index_path() + "!";
+	}
+}
+
+// One line per arch: path, arch, symbol and where the arch has it from
+static void apply_find_symbol(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	// Edits drop the index of the archs they change
+	bool indexed = std::all_of(macho.archs.begin(), macho.archs.end(), [](const MachOArch &arch) {
+		return arch.symbol_index != NULL;
+	});
+	if(!indexed && !macho.load_symbol_index()) {
+		macho.index_symbols();
+	}
+
+	for(auto &arch : macho.archs) {
+		const fat_arch_64 &fat_arch = arch.fat_arch;
+		out << macho.filename << "\t" << cpu_name(fat_arch.cputype, fat_arch.cpusubtype & ~CPU_SUBTYPE_MASK) << "\t" << args[0] << "\t";
+
+		symbol_location location;
+		if(!arch.find_symbol(args[0], location)) {
+			out << "missing\n";
+		} else if(location.defined) {
+			out << (location.weak? "weak-defined": "defined") << "\t" << (location.section.empty()? "-": location.section) << "\t0x" << std::hex << location.value << std::dec << "\n";
+		} else {
+			out << (location.weak? "weak-imported": "imported") << "\t" << (location.library.empty()? "-": location.library) << "\n";
+		}
+	}
+}
+
+static void apply_fixups(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	for(uint32_t i = 0; i < macho.n_archs; i++) {
+		out << macho.archs[i].description() << ":\n";
+
+		if(!macho.archs[i].has_load_command(LC_DYLD_CHAINED_FIXUPS)) {
+			out << "No chained fixups.\n";
+			continue;
+		}
+
+		ChainedFixups fixups(macho, i);
+		fixups.print(fixups.walk(macho.n_threads), out);
+	}
+}
+
+static void apply_bindings(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	for(uint32_t i = 0; i < macho.n_archs; i++) {
+		out << macho.archs[i].description() << ":\n";
+
+		if(!macho.archs[i].has_load_command(LC_DYLD_INFO) && !macho.archs[i].has_load_command(LC_DYLD_INFO_ONLY)) {
+			out << "No rebase or bind opcodes.\n";
+			continue;
+		}
+
+		DyldInfo info(macho, i);
+		for(int stream = 0; stream < N_OPCODE_STREAMS; stream++) {
+			info.print((opcode_stream)stream, out);
+		}
+	}
+}
+
+static void apply_exports(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	for(uint32_t i = 0; i < macho.n_archs; i++) {
+		out << macho.archs[i].description() << ":\n";
+
+		ExportTrie(macho, i).print(out);
+	}
+}
+
+// One line per arch: path, arch, name and the export's flags and address
+static void apply_find_export(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	for(uint32_t i = 0; i < macho.n_archs; i++) {
+		const fat_arch_64 &fat_arch = macho.archs[i].fat_arch;
+		out << macho.filename << "\t" << cpu_name(fat_arch.cputype, fat_arch.cpusubtype & ~CPU_SUBTYPE_MASK) << "\t" << args[0] << "\t";
+
+		export_entry entry;
+		if(!ExportTrie(macho, i).find(args[0], entry)) {
+			out << "missing\n";
+		} else if(entry.flags & EXPORT_SYMBOL_FLAGS_REEXPORT) {
+			out << "re-export\t" << entry.other << "\t" << (entry.import_name.empty()? entry.name: entry.import_name) << "\n";
+		} else {
+			out << "export\t0x" << std::hex << entry.flags << "\t0x" << entry.address << std::dec << "\n";
+		}
+	}
+}
+
+// Rebuilds the export trie of every arch without the matching exports
+static void apply_remove_exports(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	std::string name = args[0];
+	bool prefix = !name.empty() && name.back() == '*';
+	if(prefix) {
+		name.pop_back();
+	}
+
+	for(uint32_t i = 0; i < macho.n_archs; i++) {
+		std::vector<export_entry> entries = ExportTrie(macho, i).entries();
+
+		size_t n_entries = entries.size();
+		entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const export_entry &entry) {
+			return prefix? !entry.name.compare(0, name.length(), name): entry.name == name;
+		}), entries.end());
+
+		if(entries.size() != n_entries) {
+			macho.replace_export_trie(i, build_export_trie(entries));
+		}
+	}
+}
+
+static void apply_fat(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	if(!macho.is_fat && !macho.make_fat()) {
+		throw "Failed to make binary fat!";
+	}
+}
+
+static void apply_thin(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	std::vector<uint32_t> indices = find_archs(macho, args[0]);
+	if(indices.empty()) {
+		throw "No " + args[0] + " arch in binary!";
+	}
+
+	if(macho.is_fat && !macho.make_thin(indices[0])) {
+		throw "Failed to make binary thin!";
+	}
+}
+
+static void apply_remove_arch(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	std::vector<uint32_t> indices = find_archs(macho, args[0]);
+	if(indices.empty()) {
+		return;
+	}
+
+	if(!macho.is_fat) {
+		throw "Can't remove the only arch of a thin binary!";
+	}
+	if(indices.size() == macho.n_archs) {
+		throw "Can't remove every arch!";
+	}
+
+	if(!macho.remove_archs(indices)) {
+		throw "Failed to remove archs!";
+	}
+}
+
+static void apply_insert_lc(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	uint32_t cmd = parse_cmd(args[0]);
+
+	for(uint32_t i = 0; i < macho.n_archs; i++) {
+		load_command *lc = create_path_cmd(cmd, macho.archs[i].mach_header.magic, args[1]);
+		if(!lc) {
+			throw "Can't insert " + cmd_name(cmd) + "!";
+		}
+
+		macho.insert_load_command(i, lc);
+		free(lc);
+	}
+}
+
+static void apply_remove_lc(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	uint32_t cmd = parse_cmd(args[0]);
+	bool any_path = args[1] == "*";
+
+	for(uint32_t i = 0; i < macho.n_archs; i++) {
+		auto &load_commands = macho.archs[i].load_commands;
+
+		for(uint32_t j = (uint32_t)load_commands.size(); j-- > 0;) {
+			const LoadCommand &lc = load_commands[j];
+			if(lc.cmd != cmd) {
+				continue;
+			}
+
+			std::string path;
+			if(any_path || (lc.get_path(path) && path == args[1])) {
+				macho.remove_load_command(i, j);
+			}
+		}
+	}
+}
+
+static void apply_remove_codesig(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	std::vector<uint32_t> signed_archs;
+	for(uint32_t i = 0; i < macho.n_archs; i++) {
+		if(macho.archs[i].has_codesignature()) {
+			signed_archs.push_back(i);
+		}
+	}
+
+	std::vector<bool> removed = macho.remove_codesignatures(signed_archs);
+	for(size_t i = 0; i < signed_archs.size(); i++) {
+		if(!removed[i]) {
+			throw "Couldn't remove codesignature from " + macho.archs[signed_archs[i]].description() + "!";
+		}
+	}
+}
+
+static void apply_filetype(MachO &macho, const std::vector<std::string> &args, std::ostream &out) {
+	uint32_t file_type;
+	if(args[0] == "execute") {
+		file_type = MH_EXECUTE;
+	} else if(args[0] == "dylib") {
+		file_type = MH_DYLIB;
+	} else if(args[0] == "bundle") {
+		file_type = MH_BUNDLE;
+	} else {
+		throw "Unknown file type: " + args[0];
+	}
+
+	for(uint32_t i = 0; i < macho.n_archs; i++) {
+		macho.change_file_type(i, file_type);
+	}
+}
+
+static const command_info commands_info[] = {
+	{"list", "", 0, true, true, true, apply_list, "Print the archs and their load commands"},
+	{"inventory", "", 0, true, true, false, apply_inventory, "Print path, arch, offset and load command, tab separated"},
+	{"symbols", "", 0, true, false, true, apply_symbols, "Print the symbols of every arch like nm"},
+	{"index-symbols", "", 0, true, false, false, apply_index_symbols, "Write the symbol index of every arch next to the binary"},
+	{"find-symbol", "<name>", 1, true, false, false, apply_find_symbol, "Print where every arch defines or imports the symbol from"},
+	{"fixups", "", 0, true, false, true, apply_fixups, "Print the chained fixups of every arch"},
+	{"bindings", "", 0, true, false, true, apply_bindings, "Print the rebases and binds of every arch"},
+	{"exports", "", 0, true, false, true, apply_exports, "Print the export trie of every arch"},
+	{"find-export", "<name>", 1, true, false, false, apply_find_export, "Look up one export in the export trie of every arch"},
+	{"remove-exports", "<name|prefix*>", 1, false, false, false, apply_remove_exports, "Remove the matching exports from the export trie"},
+	{"fat", "", 0, false, false, false, apply_fat, "Make a thin binary fat"},
+	{"thin", "<arch>", 1, false, false, false, apply_thin, "Keep only the given arch"},
+	{"remove-arch", "<arch>", 1, false, false, false, apply_remove_arch, "Remove the given arch if present"},
+	{"insert-lc", "<cmd> <path>", 2, false, false, false, apply_insert_lc, "Insert a dylib, rpath or dylinker command into every arch"},
+	{"remove-lc", "<cmd> <path|*>", 2, false, false, false, apply_remove_lc, "Remove the commands of that type with that path"},
+	{"remove-codesig", "", 0, false, false, false, apply_remove_codesig, "Remove the code signature from every arch"},
+	{"filetype", "<execute|dylib|bundle>", 1, false, false, false, apply_filetype, "Change the file type of every arch"}
+};
+
+static const command_info *find_command(const char *name) {
+	for(size_t i = 0; i < ELEMENTS(commands_info); i++) {
+		if(!strcmp(commands_info[i].name, name)) {
+			return &commands_info[i];
+		}
+	}
+	return NULL;
+}
+
+Command::Command(const std::string &name, const std::vector<std::string> &args) {
+	this->name = name;
+	this->args = args;
+}
+
+void Command::apply(MachO &macho, std::ostream &out) const {
+	const command_info *info = find_command(name.c_str());
+	if(!info) {
+		throw "Unknown command: " + name;
+	}
+
+	info->apply(macho, args, out);
+}
+
+bool is_command(const char *name) {
+	return find_command(name) != NULL;
+}
+
+bool commands_read_only(const std::vector<Command> &commands) {
+	for(auto &command : commands) {
+		const command_info *info = find_command(command.name.c_str());
+		if(!info || !info->read_only) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Whether the commands only need the headers, which HeaderLoader reads
+bool commands_headers_only(const std::vector<Command> &commands) {
+	for(auto &command : commands) {
+		const command_info *info = find_command(command.name.c_str());
+		if(!info || !info->headers_only) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void print_commands_usage() {
+	std::cout << "Commands:\n";
+
+	for(size_t i = 0; i < ELEMENTS(commands_info); i++) {
+		const command_info &info = commands_info[i];
+		std::string usage = std::string(info.name) + " " + info.args;
+
+		std::cout << "  " << std::left << std::setw(40) << usage << info.description << "\n";
+	}
+}
+
+// Commands come first, each followed by its arguments. The first word that
+// isn't a command (or everything after "--") is a binary to edit.
+bool parse_commands(int argc, const char *argv[], std::vector<Command> &commands, std::vector<std::string> &paths) {
+	int i = 0;
+	while(i < argc) {
+		if(!strcmp(argv[i], "--")) {
+			i++;
+			break;
+		}
+
+		const command_info *info = find_command(argv[i]);
+		if(!info) {
+			break;
+		}
+
+		if((size_t)(argc - i - 1) < info->n_args) {
+			std::cout << "Missing arguments for " << info->name << "\n";
+			return false;
+		}
+
+		commands.push_back(Command(info->name, std::vector<std::string>(argv + i + 1, argv + i + 1 + info->n_args)));
+		i += 1 + (int)info->n_args;
+	}
+
+	paths.assign(argv + i, argv + argc);
+
+	return !commands.empty() && !paths.empty();
+}
+
+// Applies all commands to a binary that's already been parsed. Nothing is
+// written unless all of them succeed, and nothing at all if they only read.
+bool apply_commands(const std::vector<Command> &commands, MachO &macho, std::ostream &out) {
+	const std::string &path = macho.filename;
+	bool read_only = commands_read_only(commands);
+
+	try {
+		if(!read_only) {
+			macho.begin_edits();
+		}
+
+		for(auto &command : commands) {
+			const command_info *info = find_command(command.name.c_str());
+			if(info && info->prints_path) {
+				out << path << ":\n";
+			}
+			command.apply(macho, out);
+		}
+
+		if(!read_only && !macho.commit()) {
+			throw "Couldn't write binary!";
+		}
+	} catch(const std::string &err) {
+		out << path << ": " << err << "\n";
+		return false;
+	} catch(const char *err) {
+		out << path << ": " << err << "\n";
+		return false;
+	}
+
+	return true;
+}
+
+bool run_commands(const std::vector<Command> &commands, const std::string &path, std::ostream &out, unsigned int n_threads) {
+	try {
+		MachO macho(path.c_str(), false, commands_read_only(commands));
+		macho.n_threads = n_threads;
+		return apply_commands(commands, macho, out);
+	} catch(const std::string &err) {
+		out << path << ": " << err << "\n";
+		return false;
+	} catch(const char *err) {
+		out << path << ": " << err << "\n";
+		return false;
+	}
+}
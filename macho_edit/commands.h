@@ -0,0 +1,36 @@
+#pragma once
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <mach-o/loader.h>
+
+#include "macho.h"
+
+// One non-interactive edit, e.g. "remove-arch i386", applied to every binary
+// named on the command line
+class Command {
+public:
+// Fields
+	std::string name;
+	std::vector<std::string> args;
+
+// Methods
+	Command(const std::string &name, const std::vector<std::string> &args);
+
+	void apply(MachO &macho, std::ostream &out) const;
+};
+
+uint32_t parse_cmd(const std::string &name);
+
+bool is_command(const char *name);
+bool commands_read_only(const std::vector<Command> &commands);
+bool commands_headers_only(const std::vector<Command> &commands);
+void print_commands_usage();
+
+bool parse_commands(int argc, const char *argv[], std::vector<Command> &commands, std::vector<std::string> &paths);
+bool apply_commands(const std::vector<Command> &commands, MachO &macho, std::ostream &out);
+bool run_commands(const std::vector<Command> &commands, const std::string &path, std::ostream &out, unsigned int n_threads = 1);
+
+load_command *create_path_cmd(uint32_t cmd, uint32_t magic, const std::string &path);
@@ -0,0 +1,323 @@
+#include <mach-o/loader.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "dyld_info.h"
+#include "leb128.h"
+#include "macros.h"
+
+#define MALFORMED "Malformed rebase or bind opcodes!"
+
+OpcodeDecoder::OpcodeDecoder(opcode_stream stream, const uint8_t *data, size_t size, uint32_t pointer_size) : stream(stream), start(data), p(data), end(data + size), pointer_size(pointer_size) {
+	state.segment = 0;
+	state.offset = 0;
+	state.type = REBASE_TYPE_POINTER;
+	state.lib_ordinal = 0;
+	state.symbol = NULL;
+	state.flags = 0;
+	state.addend = 0;
+}
+
+bool OpcodeDecoder::next(dyld_info_record &record) {
+	while(repeat == 0) {
+		if(done || !step()) {
+			done = true;
+			return false;
+		}
+	}
+
+	record = state;
+	state.offset += stride;
+	repeat--;
+	return true;
+}
+
+// Runs opcodes up to the next one that rebases or binds. Returns false at the
+// end of the stream.
+bool OpcodeDecoder::step() {
+	while(p < end) {
+		uint8_t opcode = *p & REBASE_OPCODE_MASK;
+		uint8_t imm = *p & REBASE_IMMEDIATE_MASK;
+		p++;
+
+		if(stream == REBASE_STREAM) {
+			switch(opcode) {
+				case REBASE_OPCODE_DONE:
+					return false;
+				case REBASE_OPCODE_SET_TYPE_IMM:
+					state.type = imm;
+					break;
+				case REBASE_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+					state.segment = imm;
+					state.offset = read_uleb128(p, end);
+					break;
+				case REBASE_OPCODE_ADD_ADDR_ULEB:
+					state.offset += read_uleb128(p, end);
+					break;
+				case REBASE_OPCODE_ADD_ADDR_IMM_SCALED:
+					state.offset += imm * pointer_size;
+					break;
+				case REBASE_OPCODE_DO_REBASE_IMM_TIMES:
+					repeat = imm;
+					stride = pointer_size;
+					break;
+				case REBASE_OPCODE_DO_REBASE_ULEB_TIMES:
+					repeat = read_uleb128(p, end);
+					stride = pointer_size;
+					break;
+				case REBASE_OPCODE_DO_REBASE_ADD_ADDR_ULEB:
+					repeat = 1;
+					stride = read_uleb128(p, end) + pointer_size;
+					break;
+				case REBASE_OPCODE_DO_REBASE_ULEB_TIMES_SKIPPING_ULEB:
+					repeat = read_uleb128(p, end);
+					stride = read_uleb128(p, end) + pointer_size;
+					break;
+				default:
+					throw MALFORMED;
+			}
+		} else {
+			switch(opcode) {
+				case BIND_OPCODE_DONE:
+					// Lazy binds are separated by DONEs so dyld can start at any of them
+					if(stream == LAZY_BIND_STREAM) {
+						break;
+					}
+					return false;
+				case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+					state.lib_ordinal = imm;
+					break;
+				case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+					state.lib_ordinal = (int32_t)read_uleb128(p, end);
+					break;
+				case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM:
+					state.lib_ordinal = imm? (int8_t)(BIND_OPCODE_MASK | imm): 0;
+					break;
+				case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM: {
+					auto *nul = (const uint8_t *)memchr(p, '\0', end - p);
+					if(!nul) {
+						throw MALFORMED;
+					}
+					state.symbol = (const char *)p;
+					state.flags = imm;
+					p = nul + 1;
+					break;
+				}
+				case BIND_OPCODE_SET_TYPE_IMM:
+					state.type = imm;
+					break;
+				case BIND_OPCODE_SET_ADDEND_SLEB:
+					state.addend = read_sleb128(p, end);
+					break;
+				case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+					state.segment = imm;
+					state.offset = read_uleb128(p, end);
+					break;
+				case BIND_OPCODE_ADD_ADDR_ULEB:
+					state.offset += read_uleb128(p, end);
+					break;
+				case BIND_OPCODE_DO_BIND:
+					repeat = 1;
+					stride = pointer_size;
+					break;
+				case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB:
+					repeat = 1;
+					stride = read_uleb128(p, end) + pointer_size;
+					break;
+				case BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED:
+					repeat = 1;
+					stride = imm * pointer_size + pointer_size;
+					break;
+				case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB:
+					repeat = read_uleb128(p, end);
+					stride = read_uleb128(p, end) + pointer_size;
+					break;
+				case BIND_OPCODE_THREADED:
+					throw "Threaded binds aren't supported!";
+				default:
+					throw MALFORMED;
+			}
+
+			if(repeat && !state.symbol) {
+				throw MALFORMED;
+			}
+		}
+
+		if(repeat) {
+			check_run();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// A run of records has to fit in its segment, which also keeps a huge repeat
+// count from a corrupt stream from running for ages
+void OpcodeDecoder::check_run() const {
+	if(segment_sizes.empty()) {
+		return;
+	}
+
+	bool ok = state.segment < segment_sizes.size();
+	if(ok) {
+		uint64_t size = segment_sizes[state.segment];
+		ok = state.offset < size;
+		if(ok && repeat > 1) {
+			ok = stride != 0 && stride < size && repeat - 1 <= (size - 1 - state.offset) / stride;
+		}
+	}
+
+	if(!ok) {
+		throw "Rebase or bind past end of segment!";
+	}
+}
+
+// Appends the rest of the stream to the table. Runs of records only differ
+// in their offsets, so every other field is filled for a whole run at once.
+void OpcodeDecoder::decode_all(dyld_info_table &table) {
+	while(repeat || (!done && step())) {
+		if(repeat > max_records - table.size()) {
+			throw "Too many rebases or binds!";
+		}
+
+		uint32_t symbol = state.symbol? (uint32_t)(state.symbol - (const char *)start): DYLD_INFO_NO_SYMBOL;
+
+		table.segment.insert(table.segment.end(), repeat, state.segment);
+		table.type.insert(table.type.end(), repeat, state.type);
+		table.lib_ordinal.insert(table.lib_ordinal.end(), repeat, state.lib_ordinal);
+		table.symbol.insert(table.symbol.end(), repeat, symbol);
+		table.flags.insert(table.flags.end(), repeat, state.flags);
+		table.addend.insert(table.addend.end(), repeat, state.addend);
+
+		table.offset.reserve(table.offset.size() + repeat);
+		for(uint64_t i = 0; i < repeat; i++) {
+			table.offset.push_back(state.offset + i * stride);
+		}
+
+		state.offset += repeat * stride;
+		repeat = 0;
+	}
+
+	done = true;
+}
+
+DyldInfo::DyldInfo(const MachO &macho, uint32_t arch_index) {
+	const MachOArch &arch = macho.archs[arch_index];
+	uint32_t magic = arch.mach_header.magic;
+
+	pointer_size = IS_64_BIT(magic)? 8: 4;
+
+	const dyld_info_command *info = NULL;
+	for(auto &lc : arch.load_commands) {
+		if((lc.cmd == LC_SEGMENT_64 && lc.cmdsize < sizeof(segment_command_64)) || (lc.cmd == LC_SEGMENT && lc.cmdsize < sizeof(segment_command))) {
+			// Skipping it would make records refer to the wrong segments
+			throw "Segment command too small!";
+		}
+
+		if(lc.cmd == LC_SEGMENT_64) {
+			auto *c = (const segment_command_64 *)lc.raw_lc;
+			segment_names.push_back(std::string(c->segname, strnlen(c->segname, sizeof(c->segname))));
+			segment_addresses.push_back(SWAP64(c->vmaddr, magic));
+			segment_sizes.push_back(SWAP64(c->vmsize, magic));
+			max_records += MIN(SWAP64(c->filesize, magic), arch.fat_arch.size) / pointer_size;
+		} else if(lc.cmd == LC_SEGMENT) {
+			auto *c = (const segment_command *)lc.raw_lc;
+			segment_names.push_back(std::string(c->segname, strnlen(c->segname, sizeof(c->segname))));
+			segment_addresses.push_back(SWAP32(c->vmaddr, magic));
+			segment_sizes.push_back(SWAP32(c->vmsize, magic));
+			max_records += MIN((uint64_t)SWAP32(c->filesize, magic), arch.fat_arch.size) / pointer_size;
+		} else if((lc.cmd == LC_DYLD_INFO || lc.cmd == LC_DYLD_INFO_ONLY) && lc.cmdsize >= sizeof(dyld_info_command)) {
+			info = (const dyld_info_command *)lc.raw_lc;
+		}
+	}
+
+	if(!info) {
+		throw "No LC_DYLD_INFO!";
+	}
+
+	libraries = arch.dylib_paths();
+
+	uint32_t offsets[N_OPCODE_STREAMS] = {
+		SWAP32(info->rebase_off, magic),
+		SWAP32(info->bind_off, magic),
+		SWAP32(info->weak_bind_off, magic),
+		SWAP32(info->lazy_bind_off, magic)
+	};
+	sizes[REBASE_STREAM] = SWAP32(info->rebase_size, magic);
+	sizes[BIND_STREAM] = SWAP32(info->bind_size, magic);
+	sizes[WEAK_BIND_STREAM] = SWAP32(info->weak_bind_size, magic);
+	sizes[LAZY_BIND_STREAM] = SWAP32(info->lazy_bind_size, magic);
+
+	for(int i = 0; i < N_OPCODE_STREAMS; i++) {
+		data[i] = sizes[i]? macho.arch_data(arch_index, offsets[i], sizes[i], storage[i]): NULL;
+		if(sizes[i] && !data[i]) {
+			throw "Rebase or bind opcodes extend past end of arch!";
+		}
+	}
+}
+
+OpcodeDecoder DyldInfo::decoder(opcode_stream stream) const {
+	OpcodeDecoder decoder(stream, data[stream], sizes[stream], pointer_size);
+	decoder.segment_sizes = segment_sizes;
+	decoder.max_records = max_records;
+	return decoder;
+}
+
+void DyldInfo::print(opcode_stream stream, std::ostream &out) const {
+	static const char *streams[] = {"rebase", "bind", "weak-bind", "lazy-bind"};
+	static const char *types[] = {"?", "pointer", "text-abs32", "text-pcrel32"};
+
+	dyld_info_table table;
+	decoder(stream).decode_all(table);
+
+	std::string buf;
+	char line[128];
+
+	for(size_t i = 0; i < table.size(); i++) {
+		uint8_t segment = table.segment[i];
+		if(segment >= segment_names.size()) {
+			throw "Rebase or bind past end of segment!";
+		}
+
+		uint8_t type = table.type[i];
+		snprintf(line, sizeof(line), "0x%016llx %-16s %-9s %s",
+			(unsigned long long)(segment_addresses[segment] + table.offset[i]),
+			segment_names[segment].c_str(),
+			streams[stream],
+			types[type < ELEMENTS(types)? type: 0]);
+		buf += line;
+
+		if(stream != REBASE_STREAM) {
+			// Weak binds go to whichever image defines the symbol first
+			if(stream != WEAK_BIND_STREAM) {
+				buf += " ";
+				buf += library_name(libraries, table.lib_ordinal[i]);
+			}
+			buf += " ";
+			buf += (const char *)data[stream] + table.symbol[i];
+
+			int64_t addend = table.addend[i];
+			if(addend) {
+				snprintf(line, sizeof(line), " %c 0x%llx", addend < 0? '-': '+', addend < 0? 0 - (unsigned long long)addend: (unsigned long long)addend);
+				buf += line;
+			}
+			if(table.flags[i] & BIND_SYMBOL_FLAGS_WEAK_IMPORT) {
+				buf += " [weak]";
+			}
+			if(table.flags[i] & BIND_SYMBOL_FLAGS_NON_WEAK_DEFINITION) {
+				buf += " [strong definition]";
+			}
+		}
+
+		buf += '\n';
+
+		if(buf.size() > 0x10000) {
+			out << buf;
+			buf.clear();
+		}
+	}
+
+	out << buf;
+	out << table.size() << " " << streams[stream] << "s.\n";
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "macho.h"
+
+#define DYLD_INFO_NO_SYMBOL 0xffffffff
+
+// The opcode streams of LC_DYLD_INFO(_ONLY), in the order of its fields
+enum opcode_stream {
+	REBASE_STREAM,
+	BIND_STREAM,
+	WEAK_BIND_STREAM,
+	LAZY_BIND_STREAM,
+
+	N_OPCODE_STREAMS
+};
+
+// One pointer to rebase or bind. Rebases only have a segment, offset and
+// type.
+struct dyld_info_record {
+	uint8_t segment;
+	uint64_t offset;
+	uint8_t type;
+
+	int32_t lib_ordinal;
+	const char *symbol;
+	uint8_t flags;
+	int64_t addend;
+};
+
+// What decode_all() makes of a stream, one array per field of the records.
+// Symbols are offsets into the stream instead of pointers.
+struct dyld_info_table {
+	std::vector<uint8_t> segment;
+	std::vector<uint64_t> offset;
+	std::vector<uint8_t> type;
+
+	std::vector<int32_t> lib_ordinal;
+	std::vector<uint32_t> symbol;
+	std::vector<uint8_t> flags;
+	std::vector<int64_t> addend;
+
+	size_t size() const {
+		return offset.size();
+	}
+};
+
+// Runs the state machine of an opcode stream, yielding one record at a time
+// so a stream can be scanned without a table of all its records. Opcodes
+// that repeat a rebase or bind are expanded lazily.
+class OpcodeDecoder {
+public:
+// Fields
+	opcode_stream stream;
+	const uint8_t *start;
+	const uint8_t *p;
+	const uint8_t *end;
+	uint32_t pointer_size;
+
+	// Sizes of the segments in memory, by segment index. Records have to be
+	// within their segment if they're given.
+	std::vector<uint64_t> segment_sizes;
+
+	// Most records decode_all() makes, so a corrupt repeat count can't make
+	// it allocate more than the binary could need
+	uint64_t max_records = (uint64_t)-1;
+
+	// The state the opcodes set
+	dyld_info_record state;
+
+	// Records still to come from the last opcode, and how far apart they are
+	uint64_t repeat = 0;
+	uint64_t stride = 0;
+
+	bool done = false;
+
+// Methods
+	OpcodeDecoder(opcode_stream stream, const uint8_t *data, size_t size, uint32_t pointer_size);
+
+	bool next(dyld_info_record &record);
+	bool step();
+	void check_run() const;
+
+	void decode_all(dyld_info_table &table);
+};
+
+// The LC_DYLD_INFO(_ONLY) opcode streams of an arch
+class DyldInfo {
+public:
+// Fields
+	uint32_t pointer_size;
+
+	const uint8_t *data[N_OPCODE_STREAMS];
+	uint32_t sizes[N_OPCODE_STREAMS];
+	std::shared_ptr<const void> storage[N_OPCODE_STREAMS];
+
+	// Segments by segment index, dylibs by library ordinal starting at 1
+	std::vector<std::string> segment_names;
+	std::vector<uint64_t> segment_addresses;
+	std::vector<uint64_t> segment_sizes;
+	std::vector<std::string> libraries;
+
+	// Pointers that fit in the segments' file contents, more than any stream
+	// rebases or binds
+	uint64_t max_records = 0;
+
+// Methods
+	DyldInfo(const MachO &macho, uint32_t arch_index);
+
+	OpcodeDecoder decoder(opcode_stream stream) const;
+
+	void print(opcode_stream stream, std::ostream &out) const;
+};
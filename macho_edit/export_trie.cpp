@@ -0,0 +1,400 @@
+#include <algorithm>
+
+#include <mach-o/loader.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "export_trie.h"
+#include "leb128.h"
+
+#define MALFORMED "Malformed export trie!"
+
+ExportTrie::ExportTrie(const MachO &macho, uint32_t arch_index) {
+	const MachOArch &arch = macho.archs[arch_index];
+
+	uint32_t offset;
+	if(arch.find_export_trie(offset, size) == (uint32_t)-1) {
+		size = 0;
+		return;
+	}
+
+	data = macho.arch_data(arch_index, offset, size, storage);
+	if(!data) {
+		throw "Export trie extends past end of arch!";
+	}
+}
+
+void ExportTrie::read_terminal(const uint8_t *p, const uint8_t *end, export_entry &entry) const {
+	entry.flags = read_uleb128(p, end);
+
+	if(entry.flags & EXPORT_SYMBOL_FLAGS_REEXPORT) {
+		entry.other = read_uleb128(p, end);
+
+		auto *nul = (const uint8_t *)memchr(p, '\0', end - p);
+		if(!nul) {
+			throw MALFORMED;
+		}
+		entry.import_name.assign((const char *)p, nul - p);
+	} else {
+		entry.address = read_uleb128(p, end);
+
+		if(entry.flags & EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER) {
+			entry.other = read_uleb128(p, end);
+		}
+	}
+}
+
+// Every node starts with the size of its terminal, the terminal, the number
+// of children and then the children: the rest of the name up to the child,
+// NUL terminated, and the child's offset
+bool ExportTrie::find(const std::string &name, export_entry &entry) const {
+	if(size == 0) {
+		return false;
+	}
+
+	const uint8_t *end = data + size;
+	const uint8_t *p = data;
+
+	const char *s = name.c_str();
+	const char *s_end = s + name.length();
+
+	// A malformed trie may loop, a valid one takes fewer steps than it has bytes
+	for(uint32_t steps = 0; steps < size; steps++) {
+		uint64_t terminal_size = read_uleb128(p, end);
+		if(terminal_size > (uint64_t)(end - p)) {
+			throw MALFORMED;
+		}
+
+		const uint8_t *children = p + terminal_size;
+
+		if(s == s_end) {
+			if(terminal_size == 0) {
+				return false;
+			}
+
+			entry = export_entry();
+			entry.name = name;
+			read_terminal(p, children, entry);
+			return true;
+		}
+
+		p = children;
+		if(p == end) {
+			throw MALFORMED;
+		}
+
+		uint8_t n_children = *p++;
+
+		const uint8_t *next = NULL;
+		for(uint8_t i = 0; i < n_children && !next; i++) {
+			const char *q = s;
+			while(p < end && *p && q < s_end && *p == (uint8_t)*q) {
+				p++;
+				q++;
+			}
+
+			bool matched = p < end && *p == '\0';
+
+			while(p < end && *p) {
+				p++;
+			}
+			if(p == end) {
+				throw MALFORMED;
+			}
+			p++;
+
+			uint64_t child = read_uleb128(p, end);
+			if(matched) {
+				if(child >= size) {
+					throw MALFORMED;
+				}
+
+				next = data + child;
+				s = q;
+			}
+		}
+
+		if(!next) {
+			return false;
+		}
+		p = next;
+	}
+
+	throw MALFORMED;
+}
+
+// Depth first, in the order of the edges. The name is kept in one buffer:
+// everything visited between a node and its next sibling is below the node,
+// so its name is still the start of the buffer.
+void ExportTrie::enumerate(const std::function<void(const export_entry &)> &callback) const {
+	if(size == 0) {
+		return;
+	}
+
+	struct frame {
+		const uint8_t *node;
+		size_t name_len;
+		const char *edge;
+		size_t edge_len;
+	};
+
+	const uint8_t *end = data + size;
+
+	std::vector<frame> stack;
+	std::vector<frame> children;
+	stack.push_back({data, 0, "", 0});
+
+	std::string name;
+	export_entry entry;
+
+	for(uint32_t visits = 0; !stack.empty(); visits++) {
+		if(visits >= size) {
+			throw MALFORMED;
+		}
+
+		frame f = stack.back();
+		stack.pop_back();
+
+		name.resize(f.name_len);
+		name.append(f.edge, f.edge_len);
+
+		const uint8_t *p = f.node;
+		uint64_t terminal_size = read_uleb128(p, end);
+		if(terminal_size >= (uint64_t)(end - p)) {
+			throw MALFORMED;
+		}
+
+		if(terminal_size) {
+			entry = export_entry();
+			entry.name = name;
+			read_terminal(p, p + terminal_size, entry);
+			callback(entry);
+		}
+
+		p += terminal_size;
+		uint8_t n_children = *p++;
+
+		children.clear();
+		for(uint8_t i = 0; i < n_children; i++) {
+			auto *nul = (const uint8_t *)memchr(p, '\0', end - p);
+			if(!nul) {
+				throw MALFORMED;
+			}
+
+			const char *edge = (const char *)p;
+			size_t edge_len = nul - p;
+			p = nul + 1;
+
+			uint64_t child = read_uleb128(p, end);
+			if(child >= size) {
+				throw MALFORMED;
+			}
+
+			children.push_back({data + child, name.length(), edge, edge_len});
+		}
+
+		stack.insert(stack.end(), children.rbegin(), children.rend());
+	}
+}
+
+std::vector<export_entry> ExportTrie::entries() const {
+	std::vector<export_entry> entries;
+	enumerate([&](const export_entry &entry) {
+		entries.push_back(entry);
+	});
+	return entries;
+}
+
+void ExportTrie::print(std::ostream &out) const {
+	std::string buf;
+	char line[64];
+
+	enumerate([&](const export_entry &entry) {
+		if(entry.flags & EXPORT_SYMBOL_FLAGS_REEXPORT) {
+			snprintf(line, sizeof(line), "%16s ", "");
+		} else {
+			snprintf(line, sizeof(line), "%016llx ", (unsigned long long)entry.address);
+		}
+
+		buf += line;
+		buf += entry.name;
+
+		switch(entry.flags & EXPORT_SYMBOL_FLAGS_KIND_MASK) {
+			case EXPORT_SYMBOL_FLAGS_KIND_THREAD_LOCAL:
+				buf += " [thread local]";
+				break;
+			case EXPORT_SYMBOL_FLAGS_KIND_ABSOLUTE:
+				buf += " [absolute]";
+				break;
+		}
+
+		if(entry.flags & EXPORT_SYMBOL_FLAGS_WEAK_DEFINITION) {
+			buf += " [weak]";
+		}
+
+		if(entry.flags & EXPORT_SYMBOL_FLAGS_REEXPORT) {
+			snprintf(line, sizeof(line), " [re-export from library %llu", (unsigned long long)entry.other);
+			buf += line;
+			if(!entry.import_name.empty()) {
+				buf += " as " + entry.import_name;
+			}
+			buf += "]";
+		} else if(entry.flags & EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER) {
+			snprintf(line, sizeof(line), " [resolver 0x%llx]", (unsigned long long)entry.other);
+			buf += line;
+		}
+
+		buf += '\n';
+
+		if(buf.size() > 0x10000) {
+			out << buf;
+			buf.clear();
+		}
+	});
+
+	out << buf;
+}
+
+struct trie_node {
+	std::vector<std::pair<std::string, uint32_t>> children;
+	std::vector<uint8_t> terminal;
+	uint32_t offset = 0;
+};
+
+static void encode_terminal(const export_entry &entry, std::vector<uint8_t> &out) {
+	append_uleb128(out, entry.flags);
+
+	if(entry.flags & EXPORT_SYMBOL_FLAGS_REEXPORT) {
+		append_uleb128(out, entry.other);
+		out.insert(out.end(), entry.import_name.begin(), entry.import_name.end());
+		out.push_back('\0');
+	} else {
+		append_uleb128(out, entry.address);
+
+		if(entry.flags & EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER) {
+			append_uleb128(out, entry.other);
+		}
+	}
+}
+
+static size_t node_size(const std::vector<trie_node> &nodes, const trie_node &node) {
+	size_t size = node.terminal.empty()? 1: uleb128_size(node.terminal.size()) + node.terminal.size();
+
+	size++;
+	for(auto &child : node.children) {
+		size += child.first.length() + 1 + uleb128_size(nodes[child.second].offset);
+	}
+
+	return size;
+}
+
+// Like ld64: nodes in depth first order, their offsets recomputed until none
+// changes, as a child's offset takes more bytes the further away it is
+std::vector<uint8_t> build_export_trie(std::vector<export_entry> entries) {
+	std::sort(entries.begin(), entries.end(), [](const export_entry &a, const export_entry &b) {
+		return a.name < b.name;
+	});
+	entries.erase(std::unique(entries.begin(), entries.end(), [](const export_entry &a, const export_entry &b) {
+		return a.name == b.name;
+	}), entries.end());
+
+	std::vector<trie_node> nodes(1);
+	for(auto &entry : entries) {
+		const std::string &name = entry.name;
+
+		uint32_t node = 0;
+		size_t pos = 0;
+
+		bool descended = true;
+		while(descended) {
+			descended = false;
+
+			for(size_t i = 0; i < nodes[node].children.size(); i++) {
+				std::string edge = nodes[node].children[i].first;
+
+				size_t common = 0;
+				while(common < edge.length() && pos + common < name.length() && edge[common] == name[pos + common]) {
+					common++;
+				}
+				if(common == 0) {
+					continue;
+				}
+
+				// Split the edge where the names part
+				if(common < edge.length()) {
+					trie_node middle;
+					middle.children.push_back(std::make_pair(edge.substr(common), nodes[node].children[i].second));
+
+					nodes.push_back(middle);
+					nodes[node].children[i] = std::make_pair(edge.substr(0, common), (uint32_t)nodes.size() - 1);
+				}
+
+				node = nodes[node].children[i].second;
+				pos += common;
+				descended = true;
+				break;
+			}
+		}
+
+		if(pos < name.length()) {
+			nodes.push_back(trie_node());
+			nodes[node].children.push_back(std::make_pair(name.substr(pos), (uint32_t)nodes.size() - 1));
+			node = (uint32_t)nodes.size() - 1;
+		}
+
+		encode_terminal(entry, nodes[node].terminal);
+	}
+
+	std::vector<uint32_t> order;
+	std::vector<uint32_t> stack(1, 0);
+	while(!stack.empty()) {
+		uint32_t node = stack.back();
+		stack.pop_back();
+		order.push_back(node);
+
+		auto &children = nodes[node].children;
+		if(children.size() > 0xff) {
+			throw "Too many children in export trie node!";
+		}
+		for(auto it = children.rbegin(); it != children.rend(); it++) {
+			stack.push_back(it->second);
+		}
+	}
+
+	size_t size = 0;
+	for(bool changed = true; changed;) {
+		changed = false;
+		size = 0;
+
+		for(auto node : order) {
+			if(nodes[node].offset != size) {
+				nodes[node].offset = (uint32_t)size;
+				changed = true;
+			}
+			size += node_size(nodes, nodes[node]);
+		}
+	}
+
+	std::vector<uint8_t> trie;
+	trie.reserve(size);
+
+	for(auto node : order) {
+		const trie_node &n = nodes[node];
+
+		if(n.terminal.empty()) {
+			trie.push_back(0);
+		} else {
+			append_uleb128(trie, n.terminal.size());
+			trie.insert(trie.end(), n.terminal.begin(), n.terminal.end());
+		}
+
+		trie.push_back((uint8_t)n.children.size());
+		for(auto &child : n.children) {
+			trie.insert(trie.end(), child.first.begin(), child.first.end());
+			trie.push_back('\0');
+			append_uleb128(trie, nodes[child.second].offset);
+		}
+	}
+
+	return trie;
+}
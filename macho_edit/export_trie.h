@@ -0,0 +1,52 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "macho.h"
+
+// A terminal of the export trie
+struct export_entry {
+	std::string name;
+	uint64_t flags = 0;
+
+	// Offset from the mach header, unless it's a re-export
+	uint64_t address = 0;
+
+	// The resolver of a stub and resolver, the library ordinal of a re-export
+	uint64_t other = 0;
+
+	// The name in the library of a re-export, empty if it's the same
+	std::string import_name;
+};
+
+// The exports of an arch as dyld sees them, from LC_DYLD_INFO(_ONLY) or
+// LC_DYLD_EXPORTS_TRIE. find() only follows the edges on the way to one
+// name, so a lookup doesn't depend on the size of the trie.
+class ExportTrie {
+public:
+// Fields
+	const uint8_t *data = NULL;
+	uint32_t size = 0;
+
+	// The mapped file or a copy of the trie
+	std::shared_ptr<const void> storage;
+
+// Methods
+	ExportTrie(const MachO &macho, uint32_t arch_index);
+
+	void read_terminal(const uint8_t *p, const uint8_t *end, export_entry &entry) const;
+
+	bool find(const std::string &name, export_entry &entry) const;
+	void enumerate(const std::function<void(const export_entry &)> &callback) const;
+	std::vector<export_entry> entries() const;
+
+	void print(std::ostream &out) const;
+};
+
+std::vector<uint8_t> build_export_trie(std::vector<export_entry> entries);
@@ -0,0 +1,128 @@
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "file_map.h"
+#include "macros.h"
+
+FileMap::FileMap(int fd, bool writable) {
+	this->fd = fd;
+	this->writable = writable;
+
+	remap();
+}
+
+FileMap::FileMap(size_t size) {
+	this->fd = -1;
+	this->writable = false;
+	this->size = size;
+}
+
+FileMap::~FileMap() {
+	unmap();
+}
+
+void FileMap::remap() {
+	unmap();
+
+	struct stat s;
+	if(fstat(fd, &s) != 0) {
+		throw "Couldn't stat file!";
+	}
+
+	// mmap doesn't accept empty mappings
+	if(s.st_size == 0) {
+		return;
+	}
+
+	int prot = writable? PROT_READ | PROT_WRITE: PROT_READ;
+	void *ptr = mmap(NULL, (size_t)s.st_size, prot, MAP_SHARED, fd, 0);
+	if(ptr == MAP_FAILED) {
+		throw "Couldn't map file!";
+	}
+
+	base = (uint8_t *)ptr;
+	size = (size_t)s.st_size;
+}
+
+void FileMap::unmap() {
+	if(base) {
+		munmap(base, size);
+		size = 0;
+	}
+
+	base = NULL;
+}
+
+bool FileMap::contains(off_t offset, size_t len) const {
+	return offset >= 0 && (size_t)offset <= size && len <= size - (size_t)offset;
+}
+
+const void *FileMap::at(off_t offset, size_t len) const {
+	if(!contains(offset, len)) {
+		return NULL;
+	}
+
+	if(base) {
+		return base + offset;
+	}
+
+	for(auto &chunk : chunks) {
+		off_t start = chunk.first;
+		if(offset >= start && (size_t)(offset - start) + len <= chunk.second.size()) {
+			return chunk.second.data() + (offset - start);
+		}
+	}
+
+	return NULL;
+}
+
+// How many bytes from offset on at() can return in one piece
+size_t FileMap::available(off_t offset) const {
+	if(!contains(offset, 0)) {
+		return 0;
+	}
+
+	if(base) {
+		return size - (size_t)offset;
+	}
+
+	size_t len = 0;
+	for(auto &chunk : chunks) {
+		off_t start = chunk.first;
+		if(offset >= start && (size_t)(offset - start) < chunk.second.size()) {
+			len = MAX(len, chunk.second.size() - (size_t)(offset - start));
+		}
+	}
+
+	return len;
+}
+
+bool FileMap::write(off_t offset, const void *ptr, size_t len) {
+	if(!writable || !base || !contains(offset, len)) {
+		return false;
+	}
+
+	memcpy(base + offset, ptr, len);
+	return true;
+}
+
+// Bytes that continue a chunk are appended to the longest one, the one
+// available() measured, so a range read in two parts can still be had with
+// one at()
+void FileMap::add(off_t offset, std::vector<uint8_t> bytes) {
+	std::vector<uint8_t> *longest = NULL;
+	off_t longest_start = offset;
+	for(auto &chunk : chunks) {
+		if(chunk.first < longest_start && chunk.first + (off_t)chunk.second.size() == offset) {
+			longest = &chunk.second;
+			longest_start = chunk.first;
+		}
+	}
+
+	if(longest) {
+		longest->insert(longest->end(), bytes.begin(), bytes.end());
+	} else {
+		chunks.push_back(std::make_pair(offset, std::move(bytes)));
+	}
+}
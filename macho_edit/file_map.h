@@ -0,0 +1,39 @@
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+class FileMap {
+public:
+// Fields
+	int fd;
+	bool writable;
+
+	uint8_t *base = NULL;
+	size_t size = 0;
+
+	// Without a mapping only these ranges, read by HeaderLoader, are available
+	std::vector<std::pair<off_t, std::vector<uint8_t>>> chunks;
+
+// Methods
+	FileMap(int fd, bool writable);
+	FileMap(size_t size);
+	~FileMap();
+
+	FileMap(const FileMap &other) = delete;
+	FileMap &operator=(const FileMap &other) = delete;
+
+	void remap();
+	void unmap();
+
+	bool contains(off_t offset, size_t len) const;
+	const void *at(off_t offset, size_t len) const;
+	size_t available(off_t offset) const;
+	bool write(off_t offset, const void *ptr, size_t len);
+
+	void add(off_t offset, std::vector<uint8_t> bytes);
+};
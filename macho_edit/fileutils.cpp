@@ -1,62 +1,345 @@
+#include <utility>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
 #include "fileutils.h"
 #include "macros.h"
 
-#define BUFSIZE 512
+#define ZERO_BUFSIZE (1 << 16)
+#define COPY_BUFSIZE (1 << 20)
+#define COPY_ALIGN 4096
 
-void fzero(FILE *f, off_t offset, size_t len) {
-	static unsigned char zeros[BUFSIZE] = {0};
-	fseeko(f, offset, SEEK_SET);
+bool pread_all(int fd, void *buf, size_t len, off_t offset) {
+	uint8_t *p = (uint8_t *)buf;
+	while(len != 0) {
+		ssize_t n = pread(fd, p, len, offset);
+		if(n <= 0) {
+			return false;
+		}
+
+		p += n;
+		len -= n;
+		offset += n;
+	}
+
+	return true;
+}
+
+bool pwrite_all(int fd, const void *buf, size_t len, off_t offset) {
+	const uint8_t *p = (const uint8_t *)buf;
+	while(len != 0) {
+		ssize_t n = pwrite(fd, p, len, offset);
+		if(n <= 0) {
+			return false;
+		}
+
+		p += n;
+		len -= n;
+		offset += n;
+	}
+
+	return true;
+}
+
+static bool write_zeros(int fd, off_t offset, size_t len) {
+	static unsigned char zeros[ZERO_BUFSIZE] = {0};
 	while(len != 0) {
 		size_t size = MIN(len, sizeof(zeros));
-		fwrite(zeros, size, 1, f);
+		if(!pwrite_all(fd, zeros, size, offset)) {
+			return false;
+		}
+
+		offset += size;
 		len -= size;
 	}
+
+	return true;
+}
+
+// Zeroes the range without writing any data, by asking the filesystem to
+// zero or deallocate the blocks. Returns false if it isn't supported.
+#if defined(__linux__)
+static bool kernel_zero(int fd, off_t offset, size_t len) {
+	if(fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, len) == 0) {
+		return true;
+	}
+
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len) == 0;
+}
+#elif defined(F_PUNCHHOLE)
+static bool kernel_zero(int fd, off_t offset, size_t len) {
+	struct statfs s;
+	if(fstatfs(fd, &s) != 0 || s.f_bsize == 0) {
+		return false;
+	}
+
+	// F_PUNCHHOLE only takes whole blocks, the partial blocks at either end
+	// are written normally
+	off_t block = s.f_bsize;
+	off_t start = ROUND_UP(offset, block);
+	off_t end = (offset + (off_t)len) / block * block;
+	if(start >= end) {
+		return false;
+	}
+
+	fpunchhole_t args = {};
+	args.fp_offset = start;
+	args.fp_length = end - start;
+	if(fcntl(fd, F_PUNCHHOLE, &args) != 0) {
+		return false;
+	}
+
+	return write_zeros(fd, offset, start - offset) && write_zeros(fd, end, offset + len - end);
+}
+#else
+static bool kernel_zero(int, off_t, size_t) {
+	return false;
 }
+#endif
 
-void fmove(FILE *f, off_t dst, off_t src, size_t len) {
-	if(dst == src) {
+void fzero(FILE *f, off_t offset, size_t len) {
+	if(len == 0) {
 		return;
 	}
 
-	unsigned char buf[BUFSIZE];
+	fflush(f);
+	int fd = fileno(f);
+
+	// Only the part inside the file can be zeroed in place, anything past
+	// the end has to be written to extend the file
+	struct stat s;
+	if(fstat(fd, &s) == 0 && offset < s.st_size) {
+		size_t inside = (size_t)MIN((off_t)len, s.st_size - offset);
+		if(kernel_zero(fd, offset, inside)) {
+			offset += inside;
+			len -= inside;
+		}
+	}
+
+	write_zeros(fd, offset, len);
+}
+
+// Copies as much as possible without the data passing through userspace.
+// Returns the number of bytes copied, which is less than len if the kernel
+// can't do it (different filesystems, unsupported, ...).
+#ifdef __linux__
+static size_t kernel_copy(int fd_dst, off_t dst, int fd_src, off_t src, size_t len) {
+	size_t copied = 0;
+	while(copied != len) {
+		loff_t in = src + copied;
+		loff_t out = dst + copied;
+		ssize_t n = copy_file_range(fd_src, &in, fd_dst, &out, len - copied, 0);
+		if(n <= 0) {
+			break;
+		}
+
+		copied += n;
+	}
+	return copied;
+}
+#else
+static size_t kernel_copy(int, off_t, int, off_t, size_t) {
+	return 0;
+}
+#endif
+
+// If fd_dst == fd_src the kernel path is only allowed for non-overlapping ranges
+static bool copy_range(int fd_dst, off_t dst, int fd_src, off_t src, size_t len, void *buf) {
+	if(fd_dst != fd_src || ABSDIFF(dst, src) >= len) {
+		size_t copied = kernel_copy(fd_dst, dst, fd_src, src, len);
+		dst += copied;
+		src += copied;
+		len -= copied;
+	}
+
+	while(len != 0) {
+		size_t size = MIN(len, COPY_BUFSIZE);
+		if(!pread_all(fd_src, buf, size, src) || !pwrite_all(fd_dst, buf, size, dst)) {
+			return false;
+		}
+
+		len -= size;
+		src += size;
+		dst += size;
+	}
+
+	return true;
+}
+
+static void *alloc_copy_buffer() {
+	void *buf;
+	if(posix_memalign(&buf, COPY_ALIGN, COPY_BUFSIZE) != 0) {
+		return NULL;
+	}
+	return buf;
+}
+
+// Moves a range a short distance towards the end of the file while reading
+// front to back, by always reading the next block before the current one is
+// written over its start. shift must not be more than COPY_BUFSIZE.
+static bool shift_forward(int fd, off_t dst, off_t src, size_t len, void *cur, void *next) {
+	size_t done = 0;
+	size_t size = MIN(len, COPY_BUFSIZE);
+	if(!pread_all(fd, cur, size, src)) {
+		return false;
+	}
+
+	while(size != 0) {
+		size_t next_size = MIN(len - done - size, COPY_BUFSIZE);
+		if(next_size != 0 && !pread_all(fd, next, next_size, src + done + size)) {
+			return false;
+		}
+
+		if(!pwrite_all(fd, cur, size, dst + done)) {
+			return false;
+		}
+
+		done += size;
+		size = next_size;
+		std::swap(cur, next);
+	}
+
+	return true;
+}
+
+bool fmove(FILE *f, off_t dst, off_t src, size_t len) {
+	if(dst == src || len == 0) {
+		return true;
+	}
+
+	if(fflush(f) != 0) {
+		return false;
+	}
+	int fd = fileno(f);
+
+	void *buf = alloc_copy_buffer();
+	if(!buf) {
+		return false;
+	}
+
+	if(dst > src && dst - src <= COPY_BUFSIZE) {
+		void *next = alloc_copy_buffer();
+		if(next) {
+			bool ok = shift_forward(fd, dst, src, len, buf, next);
+			free(next);
+			free(buf);
+			return ok;
+		}
+	}
+
+	bool ok = true;
 	if(dst < src) {
-		while(len != 0) {
-			size_t size = MIN(len, sizeof(buf));
-			fseeko(f, src, SEEK_SET);
-			fread(&buf, size, 1, f);
-			fseeko(f, dst, SEEK_SET);
-			fwrite(buf, size, 1, f);
+		while(ok && len != 0) {
+			size_t size = MIN(len, COPY_BUFSIZE);
+			ok = copy_range(fd, dst, fd, src, size, buf);
 
 			len -= size;
 			src += size;
 			dst += size;
 		}
 	} else {
-		while(len != 0) {
-			size_t size = MIN(len, sizeof(buf));
-			fseeko(f, src + len - size, SEEK_SET);
-			fread(&buf, size, 1, f);
-			fseeko(f, dst + len - size, SEEK_SET);
-			fwrite(buf, size, 1, f);
+		while(ok && len != 0) {
+			size_t size = MIN(len, COPY_BUFSIZE);
+			ok = copy_range(fd, dst + len - size, fd, src + len - size, size, buf);
 
 			len -= size;
 		}
 	}
+
+	free(buf);
+
+	return ok;
+}
+
+bool fcpy(FILE *fdst, off_t dst, FILE *fsrc, off_t src, size_t len) {
+	if(len == 0) {
+		return true;
+	}
+
+	if(fflush(fdst) != 0 || fflush(fsrc) != 0) {
+		return false;
+	}
+
+	void *buf = alloc_copy_buffer();
+	if(!buf) {
+		return false;
+	}
+
+	bool ok = copy_range(fileno(fdst), dst, fileno(fsrc), src, len, buf);
+
+	free(buf);
+
+	return ok;
 }
 
-void fcpy(FILE *fdst, off_t dst, FILE *fsrc, off_t src, size_t len) {
-	unsigned char buf[BUFSIZE];
+// Makes the destination range share the source's blocks (btrfs, XFS) instead
+// of copying them. Both offsets must be block aligned, and so must the length
+// unless the range runs to the end of the source file.
+// Returns the number of bytes cloned from the start of the range.
+#ifdef __linux__
+static size_t kernel_clone(int fd_dst, off_t dst, int fd_src, off_t src, size_t len) {
+	struct stat s;
+	if(fstat(fd_src, &s) != 0 || s.st_blksize <= 0) {
+		return 0;
+	}
 
-	fseeko(fdst, dst, SEEK_SET);
-	fseeko(fsrc, src, SEEK_SET);
+	off_t block = s.st_blksize;
+	if(src % block != 0 || dst % block != 0) {
+		return 0;
+	}
 
-	while(len != 0) {
-		size_t size = MIN(len, sizeof(buf));
-		fread(&buf, size, 1, fsrc);
-		fwrite(buf, size, 1, fdst);
+	if(src + (off_t)len != s.st_size) {
+		len = len / block * block;
+	}
 
-		len -= size;
+	if(len == 0) {
+		return 0;
 	}
+
+	file_clone_range args;
+	args.src_fd = fd_src;
+	args.src_offset = src;
+	args.src_length = len;
+	args.dest_offset = dst;
+	if(ioctl(fd_dst, FICLONERANGE, &args) != 0) {
+		return 0;
+	}
+
+	return len;
+}
+#else
+// macOS can only clone whole files (clonefile), not ranges
+static size_t kernel_clone(int, off_t, int, off_t, size_t) {
+	return 0;
+}
+#endif
+
+// Clones what it can and copies the rest. Sets cloned to whether any of the
+// range was cloned.
+bool fclone(FILE *fdst, off_t dst, FILE *fsrc, off_t src, size_t len, bool *cloned) {
+	fflush(fdst);
+	fflush(fsrc);
+
+	size_t n_cloned = 0;
+	if(fdst != fsrc) {
+		n_cloned = kernel_clone(fileno(fdst), dst, fileno(fsrc), src, len);
+	}
+
+	if(cloned) {
+		*cloned = n_cloned != 0;
+	}
+
+	return fcpy(fdst, dst + n_cloned, fsrc, src + n_cloned, len - n_cloned);
 }
 
 size_t fpeek(void *ptr, size_t size, size_t nitems, FILE *stream) {
@@ -64,3 +347,11 @@ size_t fpeek(void *ptr, size_t size, size_t nitems, FILE *stream) {
 	fseeko(stream, -(result * size), SEEK_CUR);
 	return result;
 }
+
+int64_t mtime_nsec(const struct stat &s) {
+#ifdef __linux__
+	return s.st_mtim.tv_nsec;
+#else
+	return s.st_mtimespec.tv_nsec;
+#endif
+}
@@ -1,8 +1,17 @@
 #pragma once
 
+#include <stdint.h>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 void fzero(FILE *f, off_t offset, size_t len);
-void fmove(FILE *f, off_t dst, off_t src, size_t len);
-void fcpy(FILE *fdst, off_t dst, FILE *fsrc, off_t src, size_t len);
+bool fmove(FILE *f, off_t dst, off_t src, size_t len);
+bool fcpy(FILE *fdst, off_t dst, FILE *fsrc, off_t src, size_t len);
+bool fclone(FILE *fdst, off_t dst, FILE *fsrc, off_t src, size_t len, bool *cloned = NULL);
 size_t fpeek(void *ptr, size_t size, size_t nitems, FILE *stream);
+
+bool pread_all(int fd, void *buf, size_t len, off_t offset);
+bool pwrite_all(int fd, const void *buf, size_t len, off_t offset);
+
+int64_t mtime_nsec(const struct stat &s);
@@ -0,0 +1,393 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#else
+#include <aio.h>
+#endif
+
+#include "fileutils.h"
+#include "header_loader.h"
+#include "macros.h"
+
+// Read speculatively at the start of the file and of every slice, it
+// usually holds the fat archs or the mach header and all load commands
+#define HEADER_READ_SIZE 0x1000
+
+#ifdef __linux__
+#define URING_ENTRIES 256
+#elif !defined(AIO_LISTIO_MAX)
+#define AIO_LISTIO_MAX 16
+#endif
+
+struct header_read {
+	size_t file;
+	int fd;
+	off_t offset;
+	std::vector<uint8_t> bytes;
+	bool done;
+};
+
+// Adds the ranges that still have to be read before the file can be parsed,
+// found by following the headers that have been read so far. Anything that
+// points past the end of the file is left for the parser to complain about.
+static void missing_ranges(const FileMap &map, std::vector<std::pair<off_t, size_t>> &ranges) {
+	auto have = [&](off_t offset, size_t len) {
+		if(offset < 0 || (size_t)offset >= map.size) {
+			return false;
+		}
+
+		len = MIN(len, map.size - (size_t)offset);
+
+		// Only the part that isn't there yet, which FileMap::add() joins to
+		// what is
+		size_t available = map.available(offset);
+		if(available >= len) {
+			return true;
+		}
+
+		ranges.push_back(std::make_pair(offset + (off_t)available, len - available));
+		return false;
+	};
+
+	auto have_arch = [&](off_t offset) {
+		if(!have(offset, HEADER_READ_SIZE)) {
+			return;
+		}
+
+		auto *mh = (mach_header *)map.at(offset, sizeof(mach_header));
+		if(!mh || !IS_MAGIC(mh->magic)) {
+			return;
+		}
+
+		have(offset + MH_SIZE(mh->magic), SWAP32(mh->sizeofcmds, mh->magic));
+	};
+
+	if(!have(0, HEADER_READ_SIZE)) {
+		return;
+	}
+
+	auto *magic_ptr = (uint32_t *)map.at(0, 2 * sizeof(uint32_t));
+	if(!magic_ptr || !IS_MACHO(magic_ptr[0], magic_ptr[1])) {
+		return;
+	}
+
+	uint32_t magic = *magic_ptr;
+	if(!IS_FAT(magic)) {
+		have_arch(0);
+		return;
+	}
+
+	auto *fh = (fat_header *)map.at(0, sizeof(fat_header));
+	if(!fh) {
+		return;
+	}
+
+	uint32_t n_archs = SWAP32(fh->nfat_arch, magic);
+	size_t arch_size = FAT_ARCH_SIZE(magic);
+	if(!have(0, sizeof(fat_header) + n_archs * arch_size)) {
+		return;
+	}
+
+	auto *raw_archs = (uint8_t *)map.at(sizeof(fat_header), n_archs * arch_size);
+	if(!raw_archs) {
+		return;
+	}
+
+	for(uint32_t i = 0; i < n_archs; i++) {
+		if(IS_FAT_64(magic)) {
+			have_arch(SWAP64(((fat_arch_64 *)raw_archs)[i].offset, magic));
+		} else {
+			have_arch(SWAP32(((fat_arch *)raw_archs)[i].offset, magic));
+		}
+	}
+}
+
+#ifdef __linux__
+struct uring {
+	int fd = -1;
+	io_uring_params params;
+
+	uint8_t *sq = (uint8_t *)MAP_FAILED;
+	size_t sq_size = 0;
+	uint8_t *cq = (uint8_t *)MAP_FAILED;
+	size_t cq_size = 0;
+	io_uring_sqe *sqes = (io_uring_sqe *)MAP_FAILED;
+	size_t sqes_size = 0;
+
+	~uring() {
+		if(sqes != MAP_FAILED) {
+			munmap(sqes, sqes_size);
+		}
+		if(cq != MAP_FAILED) {
+			munmap(cq, cq_size);
+		}
+		if(sq != MAP_FAILED) {
+			munmap(sq, sq_size);
+		}
+		if(fd >= 0) {
+			close(fd);
+		}
+	}
+};
+
+// Queues the reads in an io_uring URING_ENTRIES at a time, each group
+// submitted and waited for with one io_uring_enter. Without io_uring (old
+// kernel, seccomp) nothing is read, and reads the kernel doesn't complete,
+// like IORING_OP_READ before Linux 5.6, are left undone.
+static void queue_reads(std::vector<header_read> &reads) {
+	uring ring;
+	memset(&ring.params, 0, sizeof(ring.params));
+
+	ring.fd = (int)syscall(__NR_io_uring_setup, (unsigned)MIN(reads.size(), (size_t)URING_ENTRIES), &ring.params);
+	if(ring.fd < 0) {
+		return;
+	}
+
+	const io_uring_params &params = ring.params;
+	ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	ring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+
+	ring.sq = (uint8_t *)mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	ring.cq = (uint8_t *)mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes = (io_uring_sqe *)mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if(ring.sq == MAP_FAILED || ring.cq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+		return;
+	}
+
+	uint32_t *sq_head = (uint32_t *)(ring.sq + params.sq_off.head);
+	uint32_t *sq_tail = (uint32_t *)(ring.sq + params.sq_off.tail);
+	uint32_t sq_mask = *(uint32_t *)(ring.sq + params.sq_off.ring_mask);
+	uint32_t *sq_array = (uint32_t *)(ring.sq + params.sq_off.array);
+
+	uint32_t *cq_head = (uint32_t *)(ring.cq + params.cq_off.head);
+	uint32_t *cq_tail = (uint32_t *)(ring.cq + params.cq_off.tail);
+	uint32_t cq_mask = *(uint32_t *)(ring.cq + params.cq_off.ring_mask);
+	auto *cqes = (io_uring_cqe *)(ring.cq + params.cq_off.cqes);
+
+	for(size_t first = 0; first < reads.size(); first += params.sq_entries) {
+		uint32_t n = (uint32_t)MIN(reads.size() - first, (size_t)params.sq_entries);
+
+		uint32_t tail = *sq_tail;
+		for(uint32_t i = 0; i < n; i++) {
+			header_read &read = reads[first + i];
+			uint32_t index = (tail + i) & sq_mask;
+
+			io_uring_sqe &sqe = ring.sqes[index];
+			memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = IORING_OP_READ;
+			sqe.fd = read.fd;
+			sqe.off = (uint64_t)read.offset;
+			sqe.addr = (uint64_t)(uintptr_t)read.bytes.data();
+			sqe.len = (uint32_t)read.bytes.size();
+			sqe.user_data = first + i;
+
+			sq_array[index] = index;
+		}
+		__atomic_store_n(sq_tail, tail + n, __ATOMIC_RELEASE);
+
+		// Once submitting fails, the reads the kernel already took (up to the
+		// ring's head) are still waited for, as it writes into their buffers
+		// until they complete
+		uint32_t to_submit = n;
+		uint32_t completed = 0;
+		bool failed = false;
+		std::vector<bool> reaped(n);
+		while(completed < (failed? __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) - tail: n)) {
+			int submitted = (int)syscall(__NR_io_uring_enter, ring.fd, failed? 0: to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+			if(submitted < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				if(!failed) {
+					failed = true;
+					continue;
+				}
+
+				// Can't wait for them either, so their buffers are left to the
+				// kernel for good and the reads get new ones
+				for(uint32_t i = 0; i < n; i++) {
+					header_read &read = reads[first + i];
+					if(!reaped[i]) {
+						read.bytes.swap(*new std::vector<uint8_t>(read.bytes.size()));
+					}
+				}
+				return;
+			}
+			if(!failed) {
+				to_submit -= MIN((uint32_t)submitted, to_submit);
+			}
+
+			uint32_t head = *cq_head;
+			uint32_t end = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+			for(; head != end; head++) {
+				const io_uring_cqe &cqe = cqes[head & cq_mask];
+				header_read &read = reads[cqe.user_data];
+				read.done = cqe.res == (int32_t)read.bytes.size();
+				reaped[cqe.user_data - first] = true;
+				completed++;
+			}
+			__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		}
+
+		if(failed) {
+			return;
+		}
+	}
+}
+#else
+// Submits the reads AIO_LISTIO_MAX at a time and waits for them
+static void queue_reads(std::vector<header_read> &reads) {
+	for(size_t first = 0; first < reads.size(); first += AIO_LISTIO_MAX) {
+		size_t n = MIN(reads.size() - first, (size_t)AIO_LISTIO_MAX);
+
+		std::vector<aiocb> cbs(n);
+		std::vector<aiocb *> list(n);
+		for(size_t i = 0; i < n; i++) {
+			header_read &read = reads[first + i];
+
+			memset(&cbs[i], 0, sizeof(aiocb));
+			cbs[i].aio_fildes = read.fd;
+			cbs[i].aio_offset = read.offset;
+			cbs[i].aio_buf = read.bytes.data();
+			cbs[i].aio_nbytes = read.bytes.size();
+			cbs[i].aio_lio_opcode = LIO_READ;
+
+			list[i] = &cbs[i];
+		}
+
+		// Even when it fails some of the reads may have completed
+		lio_listio(LIO_WAIT, list.data(), (int)n, NULL);
+
+		for(size_t i = 0; i < n; i++) {
+			header_read &read = reads[first + i];
+			read.done = aio_error(&cbs[i]) == 0 && aio_return(&cbs[i]) == (ssize_t)read.bytes.size();
+		}
+	}
+}
+#endif
+
+// Whatever the kernel's batched reads don't manage is read with pread
+static void submit_reads(std::vector<header_read> &reads) {
+	queue_reads(reads);
+
+	for(auto &read : reads) {
+		if(!read.done) {
+			read.done = pread_all(read.fd, read.bytes.data(), read.bytes.size(), read.offset);
+		}
+	}
+}
+
+HeaderLoader::HeaderLoader(size_t batch_size, ParseCache *cache) {
+	this->batch_size = batch_size;
+	this->cache = cache;
+}
+
+void HeaderLoader::load(const std::vector<std::string> &paths, std::function<void(size_t index, MachO *macho, const std::string &error)> done) {
+	for(size_t first = 0; first < paths.size(); first += batch_size) {
+		size_t n = MIN(batch_size, paths.size() - first);
+
+		std::vector<int> fds(n, -1);
+		std::vector<std::shared_ptr<FileMap>> maps(n);
+		std::vector<std::string> errors(n);
+		std::vector<struct stat> stats(n);
+		std::vector<uint8_t> cached(n);
+
+		for(size_t i = 0; i < n; i++) {
+			const char *path = paths[first + i].c_str();
+
+			if(cache && stat(path, &stats[i]) == 0) {
+				maps[i] = cache->find(stats[i]);
+				if(maps[i]) {
+					cached[i] = true;
+					continue;
+				}
+			}
+
+			fds[i] = open(path, O_RDONLY);
+			if(fds[i] < 0 || fstat(fds[i], &stats[i]) != 0) {
+				errors[i] = "Couldn't open file!";
+				continue;
+			}
+
+			maps[i] = std::make_shared<FileMap>((size_t)stats[i].st_size);
+		}
+
+		// Every round reads what the headers of the previous one pointed to:
+		// the start of the file, then the slices, then long load commands
+		while(true) {
+			std::vector<header_read> reads;
+			for(size_t i = 0; i < n; i++) {
+				if(!errors[i].empty() || cached[i]) {
+					continue;
+				}
+
+				std::vector<std::pair<off_t, size_t>> ranges;
+				missing_ranges(*maps[i], ranges);
+
+				for(auto &range : ranges) {
+					header_read read;
+					read.file = i;
+					read.fd = fds[i];
+					read.offset = range.first;
+					read.bytes.resize(range.second);
+					read.done = false;
+					reads.push_back(std::move(read));
+				}
+			}
+
+			if(reads.empty()) {
+				break;
+			}
+
+			submit_reads(reads);
+
+			for(auto &read : reads) {
+				if(!read.done) {
+					errors[read.file] = "Couldn't read file!";
+				} else if(errors[read.file].empty()) {
+					maps[read.file]->add(read.offset, std::move(read.bytes));
+				}
+			}
+		}
+
+		for(size_t i = 0; i < n; i++) {
+			if(fds[i] >= 0) {
+				close(fds[i]);
+			}
+
+			if(!errors[i].empty()) {
+				done(first + i, NULL, errors[i]);
+				continue;
+			}
+
+			if(cache && !cached[i]) {
+				cache->insert(stats[i], maps[i]);
+			}
+
+			auto *magic = (uint32_t *)maps[i]->at(0, 2 * sizeof(uint32_t));
+			if(!magic || !IS_MACHO(magic[0], magic[1])) {
+				done(first + i, NULL, "");
+				continue;
+			}
+
+			MachO macho;
+			try {
+				macho = MachO(paths[first + i].c_str(), maps[i]);
+			} catch(const std::string &err) {
+				errors[i] = err;
+			} catch(const char *err) {
+				errors[i] = err;
+			}
+
+			done(first + i, errors[i].empty()? &macho: NULL, errors[i]);
+		}
+	}
+}
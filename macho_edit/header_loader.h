@@ -0,0 +1,29 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "file_map.h"
+#include "macho.h"
+#include "parse_cache.h"
+
+// Reads just the headers of many binaries: the fat archs, every mach header
+// and the load commands. The reads of a whole batch of files are submitted
+// together, with io_uring on Linux and lio_listio elsewhere, falling back to
+// pread where that isn't possible.
+// With a cache, files that haven't changed aren't even opened.
+class HeaderLoader {
+public:
+// Fields
+	size_t batch_size;
+	ParseCache *cache;
+
+// Methods
+	HeaderLoader(size_t batch_size = 256, ParseCache *cache = NULL);
+
+	// done is called once per path in order, with a read only MachO or an
+	// error. The error is empty if the file isn't a mach-o binary at all.
+	void load(const std::vector<std::string> &paths, std::function<void(size_t index, MachO *macho, const std::string &error)> done);
+};
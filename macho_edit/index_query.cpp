@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <iostream>
+#include <iterator>
+#include <map>
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "commands.h"
+#include "cpuinfo.h"
+#include "index_query.h"
+
+IndexQuery::IndexQuery(const char *path) {
+	fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		throw "Couldn't open index!";
+	}
+
+	try {
+		map.reset(new FileMap(fd, false));
+	} catch(...) {
+		close(fd);
+		throw;
+	}
+
+	header = (const index_header *)map->at(0, sizeof(index_header));
+	if(!header || header->magic != INDEX_MAGIC) {
+		close(fd);
+		throw "Not an index or an index of an older version!";
+	}
+
+	section_sizes = index_sections(*header);
+
+	off_t offset = sizeof(index_header);
+	for(size_t i = 0; i < N_INDEX_SECTIONS; i++) {
+		sections[i] = (const uint32_t *)map->at(offset, section_sizes[i] * sizeof(uint32_t));
+		offset += section_sizes[i] * sizeof(uint32_t);
+	}
+
+	strings = (const char *)map->at(offset, header->strings_size);
+
+	bool ok = strings && (header->strings_size == 0 || strings[header->strings_size - 1] == '\0');
+	for(size_t i = 0; i < N_INDEX_SECTIONS; i++) {
+		ok = ok && sections[i];
+	}
+
+	if(!ok) {
+		close(fd);
+		throw "Corrupt index!";
+	}
+}
+
+IndexQuery::~IndexQuery() {
+	map.reset();
+	close(fd);
+}
+
+uint32_t IndexQuery::get(index_section section, size_t i) const {
+	if(i >= section_sizes[section]) {
+		throw "Corrupt index!";
+	}
+	return sections[section][i];
+}
+
+const char *IndexQuery::string_at(uint32_t offset) const {
+	if(offset >= header->strings_size) {
+		throw "Corrupt index!";
+	}
+	return strings + offset;
+}
+
+std::string IndexQuery::arch_path(uint32_t arch) const {
+	return string_at(get(FILE_PATH, get(ARCH_FILE, arch)));
+}
+
+std::string IndexQuery::arch_name(uint32_t arch) const {
+	return cpu_name((cpu_type_t)get(ARCH_CPUTYPE, arch), (cpu_subtype_t)(get(ARCH_CPUSUBTYPE, arch) & ~CPU_SUBTYPE_MASK));
+}
+
+std::vector<uint32_t> IndexQuery::all_archs() const {
+	std::vector<uint32_t> archs(header->n_archs);
+	for(uint32_t i = 0; i < header->n_archs; i++) {
+		archs[i] = i;
+	}
+	return archs;
+}
+
+// Most archs share a handful of cputypes, so every name is only made once
+std::vector<uint32_t> IndexQuery::archs_of_cpu(const std::vector<uint32_t> &archs, const std::string &name) const {
+	std::map<std::pair<uint32_t, uint32_t>, bool> matches;
+
+	std::vector<uint32_t> found;
+	for(auto arch : archs) {
+		auto cpu = std::make_pair(get(ARCH_CPUTYPE, arch), get(ARCH_CPUSUBTYPE, arch));
+
+		auto it = matches.find(cpu);
+		if(it == matches.end()) {
+			it = matches.insert(std::make_pair(cpu, arch_name(arch) == name)).first;
+		}
+
+		if(it->second) {
+			found.push_back(arch);
+		}
+	}
+	return found;
+}
+
+std::vector<uint32_t> IndexQuery::archs_with_cmd(uint32_t cmd) const {
+	const uint32_t *keys = sections[CMD_KEYS];
+	const uint32_t *key = std::lower_bound(keys, keys + header->n_cmds, cmd);
+	if(key == keys + header->n_cmds || *key != cmd) {
+		return std::vector<uint32_t>();
+	}
+
+	uint32_t start = get(CMD_STARTS, key - keys);
+	uint32_t end = get(CMD_STARTS, key - keys + 1);
+	if(start > end || end > header->n_cmd_archs) {
+		throw "Corrupt index!";
+	}
+
+	return std::vector<uint32_t>(sections[CMD_ARCHS] + start, sections[CMD_ARCHS] + end);
+}
+
+// The archs with a command of type cmd (any if it's 0) with that path. An
+// exact path is found through the hash table, a prefix by a binary search
+// of the sorted paths.
+std::vector<uint32_t> IndexQuery::archs_with_path(uint32_t cmd, const std::string &path, bool prefix) const {
+	uint32_t first_key = 0;
+	uint32_t last_key = 0;
+
+	if(!prefix) {
+		uint32_t n_buckets = header->n_buckets;
+		for(uint32_t i = 0, bucket = index_hash(path.c_str()); n_buckets && i < n_buckets; i++, bucket++) {
+			uint32_t key = get(PATH_HASH, bucket & (n_buckets - 1));
+			if(key == INDEX_NO_ID) {
+				break;
+			}
+
+			if(path == string_at(get(PATH_KEYS, key))) {
+				first_key = key;
+				last_key = key + 1;
+				break;
+			}
+		}
+	} else {
+		const uint32_t *keys = sections[PATH_KEYS];
+		const uint32_t *key = std::lower_bound(keys, keys + header->n_paths, path, [&](uint32_t offset, const std::string &value) {
+			return strcmp(string_at(offset), value.c_str()) < 0;
+		});
+
+		first_key = last_key = (uint32_t)(key - keys);
+		while(last_key < header->n_paths && !strncmp(string_at(get(PATH_KEYS, last_key)), path.c_str(), path.length())) {
+			last_key++;
+		}
+	}
+
+	std::vector<uint32_t> archs;
+	for(uint32_t key = first_key; key < last_key; key++) {
+		uint32_t start = get(PATH_STARTS, key);
+		uint32_t end = get(PATH_STARTS, key + 1);
+
+		for(uint32_t i = start; i < end; i++) {
+			uint32_t row = get(PATH_ROWS, i);
+			if(cmd == 0 || get(ROW_CMD, row) == cmd) {
+				archs.push_back(get(ROW_ARCH, row));
+			}
+		}
+	}
+
+	std::sort(archs.begin(), archs.end());
+	archs.erase(std::unique(archs.begin(), archs.end()), archs.end());
+
+	return archs;
+}
+
+// [arch <arch>] has|lacks <cmd|*> [<path>|<prefix>*]
+bool run_query(const char *index_path, int argc, const char *argv[]) {
+	int arg = 0;
+
+	std::string cpu;
+	if(arg + 1 < argc && !strcmp(argv[arg], "arch")) {
+		cpu = argv[arg + 1];
+		arg += 2;
+	}
+
+	if(argc - arg < 2 || argc - arg > 3 || (strcmp(argv[arg], "has") && strcmp(argv[arg], "lacks"))) {
+		std::cout << "Usage: [arch <arch>] has|lacks <cmd|*> [<path>|<prefix>*]\n";
+		return false;
+	}
+
+	bool lacks = !strcmp(argv[arg], "lacks");
+	std::string cmd_arg = argv[arg + 1];
+
+	try {
+		uint32_t cmd = cmd_arg == "*"? 0: parse_cmd(cmd_arg);
+
+		IndexQuery query(index_path);
+
+		std::vector<uint32_t> archs;
+		if(argc - arg == 3) {
+			std::string path = argv[arg + 2];
+			bool prefix = !path.empty() && path.back() == '*';
+			if(prefix) {
+				path.pop_back();
+			}
+
+			archs = query.archs_with_path(cmd, path, prefix);
+		} else if(cmd != 0) {
+			archs = query.archs_with_cmd(cmd);
+		} else {
+			archs = query.all_archs();
+		}
+
+		if(lacks) {
+			std::vector<uint32_t> all = query.all_archs();
+			std::vector<uint32_t> rest;
+			std::set_difference(all.begin(), all.end(), archs.begin(), archs.end(), std::back_inserter(rest));
+			archs.swap(rest);
+		}
+
+		if(!cpu.empty()) {
+			archs = query.archs_of_cpu(archs, cpu);
+		}
+
+		uint32_t n_files = 0;
+		uint32_t last_file = INDEX_NO_ID;
+		for(auto arch : archs) {
+			std::cout << query.arch_path(arch) << "\t" << query.arch_name(arch) << "\n";
+
+			uint32_t file = query.get(ARCH_FILE, arch);
+			n_files += file != last_file;
+			last_file = file;
+		}
+
+		std::cout << archs.size() << " archs in " << n_files << " binaries.\n";
+	} catch(const std::string &err) {
+		std::cout << err << "\n";
+		return false;
+	} catch(const char *err) {
+		std::cout << err << "\n";
+		return false;
+	}
+
+	return true;
+}
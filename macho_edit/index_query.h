@@ -0,0 +1,45 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "file_map.h"
+#include "load_command_index.h"
+
+// Answers questions about the binaries in an index file straight from the
+// mapped file, using the posting lists instead of going through the rows.
+// Every id read from the file is checked before it's used.
+class IndexQuery {
+public:
+// Fields
+	int fd;
+	std::unique_ptr<FileMap> map;
+
+	const index_header *header;
+	const uint32_t *sections[N_INDEX_SECTIONS];
+	std::vector<size_t> section_sizes;
+	const char *strings;
+
+// Methods
+	IndexQuery(const char *path);
+	~IndexQuery();
+
+	IndexQuery(const IndexQuery &other) = delete;
+	IndexQuery &operator=(const IndexQuery &other) = delete;
+
+	uint32_t get(index_section section, size_t i) const;
+	const char *string_at(uint32_t offset) const;
+
+	std::string arch_path(uint32_t arch) const;
+	std::string arch_name(uint32_t arch) const;
+
+	std::vector<uint32_t> all_archs() const;
+	std::vector<uint32_t> archs_of_cpu(const std::vector<uint32_t> &archs, const std::string &name) const;
+	std::vector<uint32_t> archs_with_cmd(uint32_t cmd) const;
+	std::vector<uint32_t> archs_with_path(uint32_t cmd, const std::string &path, bool prefix) const;
+};
+
+bool run_query(const char *index_path, int argc, const char *argv[]);
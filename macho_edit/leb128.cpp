@@ -0,0 +1,74 @@
+#include "leb128.h"
+
+uint64_t read_uleb128(const uint8_t *&p, const uint8_t *end) {
+	uint64_t value = 0;
+	unsigned int shift = 0;
+
+	uint8_t byte;
+	do {
+		if(p == end) {
+			throw "ULEB128 extends past end of data!";
+		}
+
+		byte = *p++;
+		uint64_t bits = byte & 0x7f;
+
+		// Padding bytes past 64 bits are fine as long as they're zero
+		if(shift >= 64? bits != 0: (bits << shift) >> shift != bits) {
+			throw "ULEB128 too large!";
+		}
+
+		if(shift < 64) {
+			value |= bits << shift;
+		}
+		shift += 7;
+	} while(byte & 0x80);
+
+	return value;
+}
+
+int64_t read_sleb128(const uint8_t *&p, const uint8_t *end) {
+	int64_t value = 0;
+	unsigned int shift = 0;
+
+	uint8_t byte;
+	do {
+		if(p == end) {
+			throw "SLEB128 extends past end of data!";
+		}
+		if(shift >= 64) {
+			throw "SLEB128 too large!";
+		}
+
+		byte = *p++;
+		value |= (int64_t)((uint64_t)(byte & 0x7f) << shift);
+		shift += 7;
+	} while(byte & 0x80);
+
+	// Sign extend
+	if(shift < 64 && (byte & 0x40)) {
+		value |= (int64_t)(~0ULL << shift);
+	}
+
+	return value;
+}
+
+size_t uleb128_size(uint64_t value) {
+	size_t size = 1;
+	while(value >= 0x80) {
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
+
+void append_uleb128(std::vector<uint8_t> &out, uint64_t value) {
+	do {
+		uint8_t byte = value & 0x7f;
+		value >>= 7;
+		if(value) {
+			byte |= 0x80;
+		}
+		out.push_back(byte);
+	} while(value);
+}
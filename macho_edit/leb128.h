@@ -0,0 +1,14 @@
+#pragma once
+
+#include <vector>
+
+#include <stdint.h>
+
+// The variable length numbers of the dyld info, export trie and other
+// __LINKEDIT data. Reading advances p and throws if the number runs past
+// end or doesn't fit in 64 bits.
+uint64_t read_uleb128(const uint8_t *&p, const uint8_t *end);
+int64_t read_sleb128(const uint8_t *&p, const uint8_t *end);
+
+size_t uleb128_size(uint64_t value);
+void append_uleb128(std::vector<uint8_t> &out, uint64_t value);
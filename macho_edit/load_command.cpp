@@ -3,9 +3,8 @@
 
 #include <mach-o/fat.h>
 #include <mach-o/loader.h>
-#include <stdlib.h>
+#include <string.h>
 
-#include "fileutils.h"
 #include "load_command.h"
 #include "macros.h"
 #include "magicnames.h"
@@ -13,40 +12,40 @@
 LoadCommand::LoadCommand() {
 }
 
-LoadCommand::LoadCommand(uint32_t magic, FILE *f) {
+LoadCommand::LoadCommand(uint32_t magic, off_t file_offset, const load_command *raw_lc) {
 	this->magic = magic;
-	file_offset = ftello(f);
-
-	load_command lc_header;
-	PEEK(lc_header, f);
+	this->file_offset = file_offset;
+	this->raw_lc = raw_lc;
 
-	cmd = SWAP32(lc_header.cmd, magic);
-	cmdsize = SWAP32(lc_header.cmdsize, magic);
+	cmd = SWAP32(raw_lc->cmd, magic);
+	cmdsize = SWAP32(raw_lc->cmdsize, magic);
 
-	raw_lc = (load_command *)malloc(cmdsize);
-	fread((void *)raw_lc, cmdsize, 1, f);
+	// raw_lc belongs to the caller
+	mutable_lc();
 }
 
-LoadCommand::LoadCommand(uint32_t magic, off_t file_offset, load_command *raw_lc) {
+LoadCommand::LoadCommand(uint32_t magic, off_t file_offset, const load_command *raw_lc, std::shared_ptr<const void> image) {
 	this->magic = magic;
 	this->file_offset = file_offset;
+	this->raw_lc = raw_lc;
 
 	cmd = SWAP32(raw_lc->cmd, magic);
 	cmdsize = SWAP32(raw_lc->cmdsize, magic);
 
-	this->raw_lc = (load_command *)malloc(cmdsize);
-	memcpy(this->raw_lc, raw_lc, cmdsize);
+	storage = image;
 }
 
-LoadCommand::~LoadCommand() {
-	free(raw_lc);
-}
+load_command *LoadCommand::mutable_lc() {
+	if(!owned || storage.use_count() != 1) {
+		std::shared_ptr<uint8_t> copy(new uint8_t[cmdsize], std::default_delete<uint8_t[]>());
+		memcpy(copy.get(), raw_lc, cmdsize);
 
-LoadCommand::LoadCommand(const LoadCommand &other) {
-	memcpy(this, &other, sizeof(*this));
+		raw_lc = (load_command *)copy.get();
+		storage = copy;
+		owned = true;
+	}
 
-	raw_lc = (load_command *)malloc(cmdsize);
-	memcpy(raw_lc, other.raw_lc, cmdsize);
+	return (load_command *)raw_lc;
 }
 
 std::string LoadCommand::get_lc_str(lc_str lc_str) const {
@@ -56,6 +55,37 @@ std::string LoadCommand::get_lc_str(lc_str lc_str) const {
 	return std::string(&ptr[offset], cmdsize - offset);
 }
 
+// The dylib, rpath or dylinker path of the command, without the padding
+bool LoadCommand::get_path(std::string &path) const {
+	lc_str str;
+	switch(cmd) {
+		case LC_ID_DYLIB:
+		case LC_LOAD_DYLIB:
+		case LC_LOAD_WEAK_DYLIB:
+		case LC_REEXPORT_DYLIB:
+		case LC_LAZY_LOAD_DYLIB:
+		case LC_LOAD_UPWARD_DYLIB:
+			str = ((dylib_command *)raw_lc)->dylib.name;
+			break;
+		case LC_RPATH:
+			str = ((rpath_command *)raw_lc)->path;
+			break;
+		case LC_ID_DYLINKER:
+		case LC_LOAD_DYLINKER:
+			str = ((dylinker_command *)raw_lc)->name;
+			break;
+		default:
+			return false;
+	}
+
+	if(SWAP32(str.offset, magic) >= cmdsize) {
+		return false;
+	}
+
+	path = get_lc_str(str).c_str();
+	return true;
+}
+
 std::string LoadCommand::description() const {
 	std::string name = cmd_name(cmd);
 
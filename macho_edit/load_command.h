@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <string>
 
 #include <mach-o/loader.h>
@@ -9,20 +10,25 @@ class LoadCommand {
 public:
 // Fields
 	uint32_t magic;
-	load_command *raw_lc = NULL;
+	const load_command *raw_lc = NULL;
 	off_t file_offset;
 
 	uint32_t cmd;
 	uint32_t cmdsize;
 
+	// Keeps whatever raw_lc points into alive: either an image shared by all
+	// load commands of an arch, or a private copy once the command is modified
+	std::shared_ptr<const void> storage;
+	bool owned = false;
+
 // Methods
 	LoadCommand();
-	LoadCommand(uint32_t magic, FILE *f);
-	LoadCommand(uint32_t magic, off_t file_offset, load_command *raw_lc);
-	~LoadCommand();
+	LoadCommand(uint32_t magic, off_t file_offset, const load_command *raw_lc);
+	LoadCommand(uint32_t magic, off_t file_offset, const load_command *raw_lc, std::shared_ptr<const void> image);
 
-	LoadCommand(const LoadCommand &other);
+	load_command *mutable_lc();
 
 	std::string get_lc_str(union lc_str lc_str) const;
+	bool get_path(std::string &path) const;
 	std::string description() const;
 };
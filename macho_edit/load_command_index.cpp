@@ -0,0 +1,403 @@
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "file_map.h"
+#include "load_command_index.h"
+#include "macros.h"
+
+struct index_postings {
+	std::vector<uint32_t> cmd_keys;
+	std::vector<uint32_t> cmd_starts;
+	std::vector<uint32_t> cmd_archs;
+
+	std::vector<uint32_t> path_keys;
+	std::vector<uint32_t> path_starts;
+	std::vector<uint32_t> path_rows;
+	std::vector<uint32_t> path_hash;
+};
+
+// The number of elements of every section, in file order
+std::vector<size_t> index_sections(const index_header &header) {
+	std::vector<size_t> sections(N_INDEX_SECTIONS);
+
+	sections[FILE_PATH] = header.n_files;
+	sections[ARCH_FILE] = sections[ARCH_CPUTYPE] = sections[ARCH_CPUSUBTYPE] = header.n_archs;
+	sections[ROW_FILE] = sections[ROW_ARCH] = sections[ROW_CMD] = sections[ROW_CMDSIZE] = sections[ROW_STRING] = header.n_rows;
+
+	sections[CMD_KEYS] = header.n_cmds;
+	sections[CMD_STARTS] = (size_t)header.n_cmds + 1;
+	sections[CMD_ARCHS] = header.n_cmd_archs;
+
+	sections[PATH_KEYS] = header.n_paths;
+	sections[PATH_STARTS] = (size_t)header.n_paths + 1;
+	sections[PATH_ROWS] = header.n_path_rows;
+	sections[PATH_HASH] = header.n_buckets;
+
+	return sections;
+}
+
+// FNV-1a
+uint32_t index_hash(const char *str) {
+	uint32_t hash = 2166136261u;
+	for(; *str; str++) {
+		hash = (hash ^ (uint8_t)*str) * 16777619u;
+	}
+	return hash;
+}
+
+// Rows are in arch order, so the archs and rows of every posting list come
+// out sorted
+static void build_postings(const LoadCommandIndex &index, index_postings &p) {
+	std::map<uint32_t, std::vector<uint32_t>> cmds;
+	for(size_t i = 0; i < index.row_cmd.size(); i++) {
+		auto &archs = cmds[index.row_cmd[i]];
+		if(archs.empty() || archs.back() != index.row_arch[i]) {
+			archs.push_back(index.row_arch[i]);
+		}
+	}
+
+	for(auto &it : cmds) {
+		p.cmd_keys.push_back(it.first);
+		p.cmd_starts.push_back((uint32_t)p.cmd_archs.size());
+		p.cmd_archs.insert(p.cmd_archs.end(), it.second.begin(), it.second.end());
+	}
+	p.cmd_starts.push_back((uint32_t)p.cmd_archs.size());
+
+	std::unordered_map<uint32_t, uint32_t> keys;
+	for(auto offset : index.row_string) {
+		if(offset != INDEX_NO_STRING && keys.insert(std::make_pair(offset, 0)).second) {
+			p.path_keys.push_back(offset);
+		}
+	}
+
+	std::sort(p.path_keys.begin(), p.path_keys.end(), [&](uint32_t a, uint32_t b) {
+		return strcmp(index.string_at(a), index.string_at(b)) < 0;
+	});
+
+	for(uint32_t i = 0; i < p.path_keys.size(); i++) {
+		keys[p.path_keys[i]] = i;
+	}
+
+	p.path_starts.assign(p.path_keys.size() + 1, 0);
+	for(auto offset : index.row_string) {
+		if(offset != INDEX_NO_STRING) {
+			p.path_starts[keys[offset] + 1]++;
+		}
+	}
+	for(size_t i = 1; i < p.path_starts.size(); i++) {
+		p.path_starts[i] += p.path_starts[i - 1];
+	}
+
+	std::vector<uint32_t> fill(p.path_starts.begin(), p.path_starts.end() - 1);
+	p.path_rows.resize(p.path_starts.back());
+	for(uint32_t i = 0; i < index.row_string.size(); i++) {
+		if(index.row_string[i] != INDEX_NO_STRING) {
+			p.path_rows[fill[keys[index.row_string[i]]]++] = i;
+		}
+	}
+
+	// Open addressing, at most half full
+	size_t n_buckets = p.path_keys.empty()? 0: 1;
+	while(n_buckets && n_buckets < p.path_keys.size() * 2) {
+		n_buckets *= 2;
+	}
+
+	p.path_hash.assign(n_buckets, INDEX_NO_ID);
+	for(uint32_t i = 0; i < p.path_keys.size(); i++) {
+		size_t bucket = index_hash(index.string_at(p.path_keys[i])) & (n_buckets - 1);
+		while(p.path_hash[bucket] != INDEX_NO_ID) {
+			bucket = (bucket + 1) & (n_buckets - 1);
+		}
+		p.path_hash[bucket] = i;
+	}
+}
+
+uint32_t LoadCommandIndex::add_string(const std::string &str) {
+	auto it = string_offsets.find(str);
+	if(it != string_offsets.end()) {
+		return it->second;
+	}
+
+	uint32_t offset = (uint32_t)strings.size();
+	strings.insert(strings.end(), str.c_str(), str.c_str() + str.length() + 1);
+	string_offsets[str] = offset;
+
+	return offset;
+}
+
+const char *LoadCommandIndex::string_at(uint32_t offset) const {
+	return offset < strings.size()? &strings[offset]: NULL;
+}
+
+void LoadCommandIndex::add_binary(const std::string &path, const MachO &macho) {
+	uint32_t file = (uint32_t)file_path.size();
+	file_path.push_back(add_string(path));
+
+	for(auto &arch : macho.archs) {
+		uint32_t arch_id = (uint32_t)arch_file.size();
+		arch_file.push_back(file);
+		arch_cputype.push_back((uint32_t)arch.fat_arch.cputype);
+		arch_cpusubtype.push_back((uint32_t)arch.fat_arch.cpusubtype);
+
+		for(auto &lc : arch.load_commands) {
+			std::string str;
+
+			row_file.push_back(file);
+			row_arch.push_back(arch_id);
+			row_cmd.push_back(lc.cmd);
+			row_cmdsize.push_back(lc.cmdsize);
+			row_string.push_back(lc.get_path(str)? add_string(str): INDEX_NO_STRING);
+		}
+	}
+}
+
+// Appends the files of other, or only those marked in keep_files
+void LoadCommandIndex::add_index(const LoadCommandIndex &other, const std::vector<bool> *keep_files) {
+	auto copy_string = [&](uint32_t offset) {
+		return offset == INDEX_NO_STRING? INDEX_NO_STRING: add_string(other.string_at(offset));
+	};
+
+	std::vector<uint32_t> files(other.file_path.size(), INDEX_NO_ID);
+	for(size_t i = 0; i < other.file_path.size(); i++) {
+		if(keep_files && !(*keep_files)[i]) {
+			continue;
+		}
+
+		files[i] = (uint32_t)file_path.size();
+		file_path.push_back(copy_string(other.file_path[i]));
+	}
+
+	std::vector<uint32_t> archs(other.arch_file.size(), INDEX_NO_ID);
+	for(size_t i = 0; i < other.arch_file.size(); i++) {
+		uint32_t file = files[other.arch_file[i]];
+		if(file == INDEX_NO_ID) {
+			continue;
+		}
+
+		archs[i] = (uint32_t)arch_file.size();
+		arch_file.push_back(file);
+		arch_cputype.push_back(other.arch_cputype[i]);
+		arch_cpusubtype.push_back(other.arch_cpusubtype[i]);
+	}
+
+	for(size_t i = 0; i < other.row_file.size(); i++) {
+		uint32_t file = files[other.row_file[i]];
+		if(file == INDEX_NO_ID) {
+			continue;
+		}
+
+		row_file.push_back(file);
+		row_arch.push_back(archs[other.row_arch[i]]);
+		row_cmd.push_back(other.row_cmd[i]);
+		row_cmdsize.push_back(other.row_cmdsize[i]);
+		row_string.push_back(copy_string(other.row_string[i]));
+	}
+}
+
+// Keeps only the last of the files with the same path, so scanning a file
+// again replaces it. The string pool is rebuilt without unused strings.
+void LoadCommandIndex::remove_replaced_files() {
+	std::unordered_map<uint32_t, uint32_t> last;
+	for(uint32_t i = 0; i < file_path.size(); i++) {
+		last[file_path[i]] = i;
+	}
+
+	if(last.size() == file_path.size()) {
+		return;
+	}
+
+	std::vector<bool> keep(file_path.size());
+	for(uint32_t i = 0; i < file_path.size(); i++) {
+		keep[i] = last[file_path[i]] == i;
+	}
+
+	LoadCommandIndex compacted;
+	compacted.add_index(*this, &keep);
+
+	*this = std::move(compacted);
+}
+
+// Adds the binaries in paths, read on n_threads threads. Each one is indexed
+// on its own and merged in order as soon as the ones before it are done.
+bool LoadCommandIndex::scan(const std::vector<std::string> &paths, unsigned int n_threads, ParseCache *cache) {
+	struct part {
+		std::unique_ptr<LoadCommandIndex> index;
+		std::string error;
+	};
+
+	std::mutex lock;
+	std::map<size_t, part> pending;
+	size_t next = 0;
+
+	size_t n_done = 0;
+	size_t n_failed = 0;
+
+	read_binaries(paths, n_threads, cache, [&](size_t index, const std::string &file, MachO *macho, const std::string &error) {
+		part p;
+		if(macho) {
+			p.index.reset(new LoadCommandIndex());
+			p.index->add_binary(file, *macho);
+		} else if(!error.empty()) {
+			p.error = file + ": " + error;
+		}
+
+		std::lock_guard<std::mutex> guard(lock);
+		pending[index] = std::move(p);
+
+		for(auto it = pending.begin(); it != pending.end() && it->first == next; it = pending.erase(it), next++) {
+			if(it->second.index) {
+				add_index(*it->second.index);
+				n_done++;
+			} else if(!it->second.error.empty()) {
+				std::cout << it->second.error << "\n";
+				n_failed++;
+			}
+		}
+	});
+
+	std::cout << n_done << " binaries indexed, " << n_failed << " failed.\n";
+
+	return n_failed == 0;
+}
+
+bool LoadCommandIndex::read(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		return false;
+	}
+
+	LoadCommandIndex index;
+	bool ok = false;
+
+	try {
+		FileMap map(fd, false);
+
+		auto *header = (const index_header *)map.at(0, sizeof(index_header));
+		ok = header && header->magic == INDEX_MAGIC;
+
+		std::vector<uint32_t> *columns[] = {
+			&index.file_path,
+			&index.arch_file, &index.arch_cputype, &index.arch_cpusubtype,
+			&index.row_file, &index.row_arch, &index.row_cmd, &index.row_cmdsize, &index.row_string
+		};
+
+		// The posting lists are built again when the index is written
+		std::vector<size_t> sections = ok? index_sections(*header): std::vector<size_t>();
+
+		off_t offset = sizeof(index_header);
+		for(size_t i = 0; ok && i < sections.size(); i++) {
+			auto *section = (const uint32_t *)map.at(offset, sections[i] * sizeof(uint32_t));
+			ok = section != NULL;
+			if(ok && i < ELEMENTS(columns)) {
+				columns[i]->assign(section, section + sections[i]);
+			}
+			offset += sections[i] * sizeof(uint32_t);
+		}
+
+		auto *strings = ok? (const char *)map.at(offset, header->strings_size): NULL;
+		ok = strings && (header->strings_size == 0 || strings[header->strings_size - 1] == '\0');
+		if(ok) {
+			index.strings.assign(strings, strings + header->strings_size);
+		}
+	} catch(const char *err) {
+		ok = false;
+	}
+
+	close(fd);
+
+	if(!ok) {
+		return false;
+	}
+
+	// Every id has to be valid before the index is used
+	for(auto offset : index.file_path) {
+		ok = ok && offset < index.strings.size();
+	}
+	for(auto file : index.arch_file) {
+		ok = ok && file < index.file_path.size();
+	}
+	for(size_t i = 0; i < index.row_file.size(); i++) {
+		ok = ok && index.row_file[i] < index.file_path.size() && index.row_arch[i] < index.arch_file.size();
+		ok = ok && (index.row_string[i] == INDEX_NO_STRING || index.row_string[i] < index.strings.size());
+	}
+
+	if(!ok) {
+		return false;
+	}
+
+	for(size_t offset = 0; offset < index.strings.size(); offset += strlen(&index.strings[offset]) + 1) {
+		index.string_offsets[&index.strings[offset]] = (uint32_t)offset;
+	}
+
+	*this = std::move(index);
+	return true;
+}
+
+// Written to a temporary file that replaces the index once it's complete
+bool LoadCommandIndex::write(const char *path) const {
+	std::string tmp_name = std::string(path) + ".XXXXXX";
+	int tmp_fd = mkstemp(&tmp_name[0]);
+	if(tmp_fd < 0) {
+		return false;
+	}
+
+	FILE *f = fdopen(tmp_fd, "w");
+	if(!f) {
+		close(tmp_fd);
+		unlink(tmp_name.c_str());
+		return false;
+	}
+
+	// The index is meant to be shared
+	fchmod(tmp_fd, 0644);
+
+	// Zeroed so the padding at the end is too
+	index_header header = {};
+	header.magic = INDEX_MAGIC;
+	header.n_files = (uint32_t)file_path.size();
+	header.n_archs = (uint32_t)arch_file.size();
+	header.n_rows = (uint32_t)row_file.size();
+	header.strings_size = (uint32_t)strings.size();
+
+	index_postings p;
+	build_postings(*this, p);
+
+	header.n_cmds = (uint32_t)p.cmd_keys.size();
+	header.n_cmd_archs = (uint32_t)p.cmd_archs.size();
+	header.n_paths = (uint32_t)p.path_keys.size();
+	header.n_path_rows = (uint32_t)p.path_rows.size();
+	header.n_buckets = (uint32_t)p.path_hash.size();
+
+	const std::vector<uint32_t> *columns[] = {
+		&file_path,
+		&arch_file, &arch_cputype, &arch_cpusubtype,
+		&row_file, &row_arch, &row_cmd, &row_cmdsize, &row_string,
+		&p.cmd_keys, &p.cmd_starts, &p.cmd_archs,
+		&p.path_keys, &p.path_starts, &p.path_rows, &p.path_hash
+	};
+
+	bool ok = WRITE(header, f) == 1;
+	for(size_t i = 0; ok && i < ELEMENTS(columns); i++) {
+		ok = fwrite(columns[i]->data(), sizeof(uint32_t), columns[i]->size(), f) == columns[i]->size();
+	}
+	ok = ok && fwrite(strings.data(), 1, strings.size(), f) == strings.size();
+
+	ok = fclose(f) == 0 && ok;
+	ok = ok && rename(tmp_name.c_str(), path) == 0;
+	if(!ok) {
+		unlink(tmp_name.c_str());
+	}
+
+	return ok;
+}
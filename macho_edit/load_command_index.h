@@ -0,0 +1,102 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <stdint.h>
+
+#include "macho.h"
+#include "parse_cache.h"
+
+#define INDEX_MAGIC 0x327865646e69656dULL // "meindex2"
+
+#define INDEX_NO_STRING 0xffffffff
+#define INDEX_NO_ID 0xffffffff
+
+// An index file starts with this header, followed by the sections below,
+// each an array of uint32_t, and the string pool.
+struct index_header {
+	uint64_t magic;
+	uint32_t n_files;
+	uint32_t n_archs;
+	uint32_t n_rows;
+	uint32_t strings_size;
+
+	// Posting lists
+	uint32_t n_cmds;
+	uint32_t n_cmd_archs;
+	uint32_t n_paths;
+	uint32_t n_path_rows;
+	uint32_t n_buckets;
+};
+
+enum index_section {
+	// The columns, in the order of the fields of LoadCommandIndex
+	FILE_PATH,
+	ARCH_FILE,
+	ARCH_CPUTYPE,
+	ARCH_CPUSUBTYPE,
+	ROW_FILE,
+	ROW_ARCH,
+	ROW_CMD,
+	ROW_CMDSIZE,
+	ROW_STRING,
+
+	// The cmds in order, where the archs of each one start, and the sorted
+	// archs that have that cmd
+	CMD_KEYS,
+	CMD_STARTS,
+	CMD_ARCHS,
+
+	// The strings of the rows sorted by text, where the rows of each one
+	// start, the sorted rows, and a hash table of indices into PATH_KEYS
+	PATH_KEYS,
+	PATH_STARTS,
+	PATH_ROWS,
+	PATH_HASH,
+
+	N_INDEX_SECTIONS
+};
+
+std::vector<size_t> index_sections(const index_header &header);
+uint32_t index_hash(const char *str);
+
+// The load commands of many binaries, one row per load command, stored
+// column by column so an index file can be mapped and scanned as is. Paths
+// are kept once in a pool of NUL terminated strings and referred to by
+// their offset, so equal strings have equal offsets.
+class LoadCommandIndex {
+public:
+// Fields
+	// By file
+	std::vector<uint32_t> file_path;
+
+	// By arch
+	std::vector<uint32_t> arch_file;
+	std::vector<uint32_t> arch_cputype;
+	std::vector<uint32_t> arch_cpusubtype;
+
+	// By load command
+	std::vector<uint32_t> row_file;
+	std::vector<uint32_t> row_arch;
+	std::vector<uint32_t> row_cmd;
+	std::vector<uint32_t> row_cmdsize;
+	std::vector<uint32_t> row_string;
+
+	std::vector<char> strings;
+	std::unordered_map<std::string, uint32_t> string_offsets;
+
+// Methods
+	uint32_t add_string(const std::string &str);
+	const char *string_at(uint32_t offset) const;
+
+	void add_binary(const std::string &path, const MachO &macho);
+	void add_index(const LoadCommandIndex &other, const std::vector<bool> *keep_files = NULL);
+	void remove_replaced_files();
+
+	bool scan(const std::vector<std::string> &paths, unsigned int n_threads, ParseCache *cache = NULL);
+
+	bool read(const char *path);
+	bool write(const char *path) const;
+};
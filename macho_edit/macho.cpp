@@ -1,8 +1,12 @@
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
+#include <thread>
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -12,30 +16,89 @@
 #include "macho.h"
 #include "macros.h"
 #include "magicnames.h"
+#include "symbol_index.h"
 
 MachO::MachO() {
 }
 
-MachO::MachO(const char *filename) {
-	file = fopen(filename, "r+");
+MachO::MachO(const char *filename, bool writable_map, bool read_only) {
+	this->filename = filename;
+
+	file = fopen(filename, read_only? "r": "r+");
 	if(!file) {
 		throw "Couldn't open file!";
 	}
 
+	// Archs keep the file alive while their bytes are read from it
+	file_ref = std::shared_ptr<FILE>(file, fclose);
 	fd = fileno(file);
 
-	fseeko(file, 0, SEEK_END);
-	off_t fsize = ftello(file);
-	rewind(file);
+	map = std::make_shared<FileMap>(fd, writable_map);
+
+	parse();
+
+	for(auto &arch : archs) {
+		arch.set_source(file_ref);
+	}
+}
+
+// Read only, from whatever HeaderLoader read of the file
+MachO::MachO(const char *filename, std::shared_ptr<FileMap> map) {
+	this->filename = filename;
+
+	file = NULL;
+	fd = -1;
+
+	this->map = map;
+
+	parse();
+
+	for(auto &arch : archs) {
+		arch.set_source(file_ref);
+	}
+}
+
+// A fat binary of every arch of the inputs, laid out once. Nothing exists at
+// filename until rewrite() streams each slice there from its input.
+MachO::MachO(const char *filename, const std::vector<MachO> &inputs) {
+	this->filename = filename;
+
+	file = NULL;
+	fd = -1;
+
+	// dyld doesn't like FAT_MAGIC
+	fat_magic = FAT_CIGAM;
+	is_fat = true;
+
+	for(auto &input : inputs) {
+		for(auto &arch : input.archs) {
+			for(auto &other : archs) {
+				if(other.fat_arch.cputype == arch.fat_arch.cputype && other.fat_arch.cpusubtype == arch.fat_arch.cpusubtype) {
+					throw input.filename + " and another input both have an " + cpu_name(arch.fat_arch.cputype, arch.fat_arch.cpusubtype) + " arch!";
+				}
+			}
+
+			archs.push_back(arch);
+		}
+	}
 
-	if(fsize > UINT32_MAX) {
-		throw "File size larger than 2^32 bytes!";
+	n_archs = (uint32_t)archs.size();
+	if(n_archs == 0) {
+		throw "No archs to put in the binary!";
 	}
 
-	file_size = (uint32_t)fsize;
+	layout_archs();
+}
+
+void MachO::parse() {
+	file_size = map->size;
 
-	uint32_t magic;
-	PEEK(magic, file);
+	auto *magic_ptr = (uint32_t *)map->at(0, sizeof(uint32_t));
+	if(!magic_ptr) {
+		throw "File too small to be a mach-o binary!";
+	}
+
+	uint32_t magic = *magic_ptr;
 
 	if(!IS_MAGIC(magic)) {
 		std::ostringstream o;
@@ -48,90 +111,581 @@ MachO::MachO(const char *filename) {
 	if(is_fat) {
 		fat_magic = magic;
 
-		fat_header fat_header;
-		READ(fat_header, file);
-		n_archs = SWAP32(fat_header.nfat_arch, magic);
+		auto *fh = (fat_header *)map->at(0, sizeof(fat_header));
+		if(!fh) {
+			throw "Fat header extends past end of file!";
+		}
+
+		n_archs = SWAP32(fh->nfat_arch, magic);
 
+		size_t arch_size = FAT_ARCH_SIZE(magic);
+		auto *raw_archs = (uint8_t *)map->at(sizeof(fat_header), n_archs * arch_size);
+		if(!raw_archs) {
+			throw "Fat archs extend past end of file!";
+		}
+
+		archs.reserve(n_archs);
 		for(uint32_t i = 0; i < n_archs; i++) {
-			fat_arch arch;
-			READ(arch, file);
-			swap_arch(&arch);
-			archs.push_back(MachOArch(&arch, file));
+			fat_arch_64 arch;
+			if(IS_FAT_64(magic)) {
+				arch = ((fat_arch_64 *)raw_archs)[i];
+				swap_arch(&arch);
+			} else {
+				fat_arch &arch_32 = ((fat_arch *)raw_archs)[i];
+				arch.cputype = SWAP32(arch_32.cputype, magic);
+				arch.cpusubtype = SWAP32(arch_32.cpusubtype, magic);
+				arch.offset = SWAP32(arch_32.offset, magic);
+				arch.size = SWAP32(arch_32.size, magic);
+				arch.align = SWAP32(arch_32.align, magic);
+				arch.reserved = 0;
+			}
+
+			archs.push_back(MachOArch(&arch, *map));
 		}
 	} else {
 		fat_magic = FAT_CIGAM;
 
 		n_archs = 1;
 
-		mach_header mh;
-		READ(mh, file);
+		auto *mh = (mach_header *)map->at(0, sizeof(mach_header));
+		if(!mh) {
+			throw "Mach header extends past end of file!";
+		}
+
+		fat_arch_64 arch = arch_from_mach_header(*mh, file_size);
+		archs = {MachOArch(&arch, *map)};
+	}
+}
+
+void MachO::swap_arch(fat_arch_64 *arch) const {
+	arch->cputype = SWAP32(arch->cputype, fat_magic);
+	arch->cpusubtype = SWAP32(arch->cpusubtype, fat_magic);
+	arch->offset = SWAP64(arch->offset, fat_magic);
+	arch->size = SWAP64(arch->size, fat_magic);
+	arch->align = SWAP32(arch->align, fat_magic);
+	arch->reserved = SWAP32(arch->reserved, fat_magic);
+}
+
+fat_arch MachO::narrow_arch(const fat_arch_64 &arch) const {
+	fat_arch arch_32;
+
+	arch_32.cputype = SWAP32(arch.cputype, fat_magic);
+	arch_32.cpusubtype = SWAP32(arch.cpusubtype, fat_magic);
+	arch_32.offset = SWAP32(arch.offset, fat_magic);
+	arch_32.size = SWAP32(arch.size, fat_magic);
+	arch_32.align = SWAP32(arch.align, fat_magic);
+
+	return arch_32;
+}
+
+static void overlay(uint8_t *buf, off_t start, off_t end, off_t offset, const void *ptr, size_t len) {
+	off_t from = MAX(start, offset);
+	off_t to = MIN(end, offset + (off_t)len);
+	if(from < to) {
+		memcpy(buf + (from - start), (const uint8_t *)ptr + (from - offset), to - from);
+	}
+}
+
+void MachO::write_bytes(off_t offset, const void *ptr, size_t len) {
+	if(deferred) {
+		// commit() renders the final bytes from the model
+		std::lock_guard<std::mutex> lock(*edits_lock);
+		dirty_ranges.push_back(std::make_pair(offset, offset + (off_t)len));
+		return;
+	}
+
+	if(map && map->writable && map->write(offset, ptr, len)) {
+		return;
+	}
+
+	pwrite_all(fd, ptr, len, offset);
+}
+
+void MachO::zero_bytes(off_t offset, size_t len) {
+	if(deferred) {
+		std::lock_guard<std::mutex> lock(*edits_lock);
+		dirty_ranges.push_back(std::make_pair(offset, offset + (off_t)len));
+		zero_ranges.push_back(std::make_pair(offset, offset + (off_t)len));
+		return;
+	}
+
+	fzero(file, offset, len);
+}
+
+// Replaces bytes within a slice. Unlike write_bytes() the data itself is
+// kept while deferred, so it survives the slice being moved.
+void MachO::write_arch_data(uint32_t arch_index, uint64_t offset, const void *ptr, size_t len) {
+	MachOArch &arch = archs[arch_index];
+
+	if(deferred) {
+		auto *bytes = (const uint8_t *)ptr;
+		arch.patches.push_back(std::make_pair(offset, std::make_shared<const std::vector<uint8_t>>(bytes, bytes + len)));
+	}
+
+	write_bytes(arch.fat_arch.offset + offset, ptr, len);
+}
+
+// Reads bytes of a slice as they are now, wherever it currently is
+bool MachO::read_arch_data(uint32_t arch_index, uint64_t offset, void *buf, size_t len) const {
+	const MachOArch &arch = archs[arch_index];
+
+	if(offset > arch.fat_arch.size || len > arch.fat_arch.size - offset) {
+		return false;
+	}
+
+	FILE *src = arch.source_file.get();
+	fflush(src);
+
+	if(!pread_all(fileno(src), buf, len, arch.source_offset + offset)) {
+		return false;
+	}
+
+	for(auto &patch : arch.patches) {
+		overlay((uint8_t *)buf, offset, offset + len, patch.first, patch.second->data(), patch.second->size());
+	}
+
+	return true;
+}
+
+// Points at bytes of a slice as they are now: into the map if the slice is
+// mapped where it is and unchanged, otherwise into a copy. storage keeps
+// either alive.
+const uint8_t *MachO::arch_data(uint32_t arch_index, uint64_t offset, size_t len, std::shared_ptr<const void> &storage) const {
+	const MachOArch &arch = archs[arch_index];
+
+	if(offset > arch.fat_arch.size || len > arch.fat_arch.size - offset) {
+		return NULL;
+	}
+
+	if(map && arch.patches.empty() && arch.is_in_place(file)) {
+		auto *data = (const uint8_t *)map->at(arch.fat_arch.offset + offset, len);
+		if(data) {
+			storage = map;
+			return data;
+		}
+	}
+
+	auto copy = std::make_shared<std::vector<uint8_t>>(len);
+	if(!read_arch_data(arch_index, offset, copy->data(), len)) {
+		return NULL;
+	}
+
+	storage = copy;
+	return copy->data();
+}
+
+void MachO::truncate(uint64_t new_size) {
+	file_size = new_size;
+
+	if(deferred) {
+		return;
+	}
+
+	fflush(file);
+	ftruncate(fd, new_size);
+
+	if(map) {
+		map->remap();
+	}
+}
+
+void MachO::begin_edits() {
+	deferred = true;
+}
+
+// Writes out everything recorded since begin_edits(), merging the touched
+// ranges so each byte is written once, and stays in deferred mode
+void MachO::flush_edits() {
+	if(!deferred) {
+		return;
+	}
+
+	deferred = false;
+
+	struct stat s;
+	if(fstat(fd, &s) == 0 && (uint64_t)s.st_size != file_size) {
+		truncate(file_size);
+	}
+
+	std::sort(dirty_ranges.begin(), dirty_ranges.end());
+
+	std::vector<std::pair<off_t, off_t>> merged;
+	for(auto &range : dirty_ranges) {
+		if(!merged.empty() && range.first <= merged.back().second) {
+			merged.back().second = MAX(merged.back().second, range.second);
+		} else {
+			merged.push_back(range);
+		}
+	}
+
+	std::vector<uint8_t> buf;
+	for(auto &range : merged) {
+		off_t end = MIN(range.second, (off_t)file_size);
+		if(range.first >= end) {
+			continue;
+		}
+
+		size_t len = end - range.first;
+		buf.resize(len);
+		render(range.first, buf.data(), len);
+		write_bytes(range.first, buf.data(), len);
+	}
+
+	fflush(file);
+
+	dirty_ranges.clear();
+	zero_ranges.clear();
+	for(auto &arch : archs) {
+		arch.patches.clear();
+	}
+
+	deferred = true;
+}
+
+bool MachO::commit() {
+	if(deferred && layout_changed()) {
+		deferred = false;
+		return rewrite();
+	}
+
+	flush_edits();
+	deferred = false;
+
+	return true;
+}
+
+// Puts the part of the fat header and archs that falls within [start, end)
+// into buf, which holds that range
+void MachO::overlay_fat_table(uint8_t *buf, off_t start, off_t end) const {
+	fat_header fat_header;
+	fat_header.magic = fat_magic;
+	fat_header.nfat_arch = SWAP32(n_archs, fat_magic);
+	overlay(buf, start, end, 0, &fat_header, sizeof(fat_header));
+
+	off_t arch_offset = sizeof(fat_header);
+	for(auto &arch : archs) {
+		if(IS_FAT_64(fat_magic)) {
+			fat_arch_64 fat_arch = arch.fat_arch;
+			swap_arch(&fat_arch);
+			overlay(buf, start, end, arch_offset, &fat_arch, sizeof(fat_arch));
+		} else {
+			fat_arch fat_arch = narrow_arch(arch.fat_arch);
+			overlay(buf, start, end, arch_offset, &fat_arch, sizeof(fat_arch));
+		}
+		arch_offset += FAT_ARCH_SIZE(fat_magic);
+	}
+}
+
+// Produces the final contents of a range: what's on disk, with recorded
+// zeroing applied and the headers and load commands of the model on top
+void MachO::render(off_t offset, uint8_t *buf, size_t len) const {
+	off_t end = offset + (off_t)len;
+
+	memset(buf, 0, len);
+	pread(fd, buf, len, offset);
+
+	for(auto &range : zero_ranges) {
+		off_t from = MAX(offset, range.first);
+		off_t to = MIN(end, range.second);
+		if(from < to) {
+			memset(buf + (from - offset), 0, to - from);
+		}
+	}
+
+	if(is_fat) {
+		overlay_fat_table(buf, offset, end);
+	}
+
+	for(auto &arch : archs) {
+		overlay(buf, offset, end, arch.fat_arch.offset, &arch.mach_header, sizeof(arch.mach_header));
+
+		for(auto &patch : arch.patches) {
+			overlay(buf, offset, end, arch.fat_arch.offset + patch.first, patch.second->data(), patch.second->size());
+		}
+
+		for(auto &lc : arch.load_commands) {
+			overlay(buf, offset, end, lc.file_offset, lc.raw_lc, lc.cmdsize);
+		}
+	}
+}
+
+bool MachO::layout_changed() const {
+	for(auto &arch : archs) {
+		if(!arch.is_in_place(file)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Writes the slice at offset: the header pages rendered from the model, the
+// rest cloned or copied from wherever the slice currently is
+bool MachO::write_arch(FILE *out, off_t offset, const MachOArch &arch, bool *cloned) const {
+	uint64_t size = arch.fat_arch.size;
+	uint32_t magic = arch.mach_header.magic;
+	uint32_t sizeofcmds = arch.mach_header.sizeofcmds;
+
+	uint64_t cmds_end = MH_SIZE(magic) + MAX(sizeofcmds, arch.cmds_extent);
+	uint64_t head_size = MIN(ROUND_UP(cmds_end, 1 << arch.fat_arch.align), size);
+
+	FILE *src = arch.source_file.get();
+	fflush(src);
+
+	std::vector<uint8_t> head(head_size);
+	if(!pread_all(fileno(src), head.data(), head_size, arch.source_offset)) {
+		return false;
+	}
+
+	if(cmds_end <= head_size && MH_SIZE(magic) + sizeofcmds < cmds_end) {
+		memset(&head[MH_SIZE(magic) + sizeofcmds], 0, cmds_end - MH_SIZE(magic) - sizeofcmds);
+	}
+
+	for(auto &patch : arch.patches) {
+		overlay(head.data(), 0, head_size, patch.first, patch.second->data(), patch.second->size());
+	}
+
+	overlay(head.data(), 0, head_size, 0, &arch.mach_header, sizeof(arch.mach_header));
+
+	for(auto &lc : arch.load_commands) {
+		overlay(head.data(), 0, head_size, lc.file_offset - arch.fat_arch.offset, lc.raw_lc, lc.cmdsize);
+	}
+
+	fflush(out);
+	if(!pwrite_all(fileno(out), head.data(), head_size, offset)) {
+		return false;
+	}
+
+	if(!fclone(out, offset + head_size, src, arch.source_offset + head_size, size - head_size, cloned)) {
+		return false;
+	}
+
+	// What the head didn't cover
+	fflush(out);
+	for(auto &patch : arch.patches) {
+		uint64_t from = MAX(patch.first, head_size);
+		uint64_t to = MIN(patch.first + patch.second->size(), size);
+		if(from < to && !pwrite_all(fileno(out), patch.second->data() + (from - patch.first), to - from, offset + from)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Writes the whole binary described by the model to an empty file in one
+// forward pass, leaving the gaps between slices as holes
+bool MachO::write_to_file(FILE *out) const {
+	uint64_t size = 0;
+	for(auto &arch : archs) {
+		size = MAX(size, arch.fat_arch.offset + arch.fat_arch.size);
+	}
+
+	if(ftruncate(fileno(out), size) != 0) {
+		return false;
+	}
+
+	if(is_fat) {
+		size_t table_size = sizeof(fat_header) + n_archs * FAT_ARCH_SIZE(fat_magic);
+		std::vector<uint8_t> table(table_size);
+		overlay_fat_table(table.data(), 0, table_size);
+
+		if(!pwrite_all(fileno(out), table.data(), table_size, 0)) {
+			return false;
+		}
+	}
+
+	std::vector<const MachOArch *> order;
+	for(auto &arch : archs) {
+		order.push_back(&arch);
+	}
+	std::sort(order.begin(), order.end(), [](const MachOArch *a, const MachOArch *b) {
+		return a->fat_arch.offset < b->fat_arch.offset;
+	});
+
+	for(auto *arch : order) {
+		if(!write_arch(out, arch->fat_arch.offset, *arch)) {
+			return false;
+		}
+	}
+
+	return fflush(out) == 0;
+}
+
+// Streams the edited binary into a temporary file next to the original and
+// renames it over it, so the original is never left half written. A binary
+// with other hard links, or whose owner can't be kept, is copied back over
+// the original instead, so it stays the same file.
+bool MachO::rewrite() {
+	// Renaming over a symlink would replace the link, not its target
+	std::string path = filename;
+	char *real_path = realpath(filename.c_str(), NULL);
+	if(real_path) {
+		path = real_path;
+		free(real_path);
+	}
+
+	std::string tmp_name = path + ".XXXXXX";
+	int tmp_fd = mkstemp(&tmp_name[0]);
+	if(tmp_fd < 0) {
+		return false;
+	}
+
+	FILE *out = fdopen(tmp_fd, "r+");
+	if(!out) {
+		close(tmp_fd);
+		unlink(tmp_name.c_str());
+		return false;
+	}
+
+	// A new binary gets the permissions of its first input, and belongs to
+	// whoever makes it
+	int mode_fd = fd >= 0? fd: fileno(archs[0].source_file.get());
+
+	struct stat s;
+	bool ok = fstat(mode_fd, &s) == 0 && fchmod(tmp_fd, s.st_mode & 07777) == 0;
+	bool in_place = ok && fd >= 0 && (s.st_nlink > 1 || fchown(tmp_fd, s.st_uid, s.st_gid) != 0);
+	ok = ok && write_to_file(out) && fsync(tmp_fd) == 0;
+
+	if(in_place) {
+		struct stat tmp_s;
+		ok = ok && fstat(tmp_fd, &tmp_s) == 0;
+
+		// Once the copy has started the original is gone, so the temporary
+		// file is kept as the only whole copy of the binary
+		if(ok && !(fcpy(file, 0, out, 0, (size_t)tmp_s.st_size) && fflush(file) == 0 && ftruncate(fd, tmp_s.st_size) == 0 && fsync(fd) == 0)) {
+			std::cerr << "Failed to write " << path << ", the edited binary is kept in " << tmp_name << "\n";
+			fclose(out);
+			return false;
+		}
+	} else {
+		ok = ok && rename(tmp_name.c_str(), path.c_str()) == 0;
+	}
+
+	if(!ok || in_place) {
+		fclose(out);
+		unlink(tmp_name.c_str());
+		if(!ok) {
+			return false;
+		}
+	}
 
-		fat_arch arch = arch_from_mach_header(mh, file_size);
-		swap_arch(&arch);
-		archs = {MachOArch(&arch, file)};
+	bool writable_map = map && map->writable;
+
+	if(!in_place) {
+		file = out;
+		file_ref = std::shared_ptr<FILE>(out, fclose);
+		fd = tmp_fd;
+	}
+	map = std::make_shared<FileMap>(fd, writable_map);
+	file_size = map->size;
+
+	for(auto &arch : archs) {
+		arch.set_source(file_ref);
+		arch.cmds_extent = arch.mach_header.sizeofcmds;
+		arch.patches.clear();
 	}
+
+	dirty_ranges.clear();
+	zero_ranges.clear();
+
+	return true;
 }
 
-void MachO::swap_arch(fat_arch *arch) const {
-	uint32_t *fields = (uint32_t *)arch;
-	for(size_t i = 0; i < sizeof(*arch) / sizeof(uint32_t); i++) {
-		fields[i] = SWAP32(fields[i], fat_magic);
+// Places the archs one after the other, each at its alignment, after a fat
+// header that's 64-bit if any of them needs it
+void MachO::layout_archs() {
+	while(true) {
+		uint64_t end = sizeof(fat_header) + n_archs * FAT_ARCH_SIZE(fat_magic);
+		for(auto &arch : archs) {
+			uint64_t offset = ROUND_UP(end, 1 << arch.fat_arch.align);
+			arch.set_offset(offset);
+			end = offset + arch.fat_arch.size;
+		}
+
+		file_size = end;
+
+		if(IS_FAT_64(fat_magic) || !needs_fat_64()) {
+			break;
+		}
+		fat_magic = FAT_CIGAM_64;
 	}
 }
 
-void MachO::write_fat_header() const {
+bool MachO::needs_fat_64() const {
+	for(auto &arch : archs) {
+		if(arch.fat_arch.offset > UINT32_MAX || arch.fat_arch.size > UINT32_MAX) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void MachO::write_fat_header() {
 	if(!is_fat) {
 		return;
 	}
 
-	rewind(file);
 	fat_header fat_header;
 
 	fat_header.magic = fat_magic;
 	fat_header.nfat_arch = SWAP32(n_archs, fat_magic);
 
-	WRITE(fat_header, file);
+	write_bytes(0, &fat_header, sizeof(fat_header));
 }
 
 void MachO::write_fat_archs() {
 	if(!is_fat) {
 		const MachOArch &arch = archs[0];
-		uint32_t arch_size = arch.fat_arch.size;
+		uint64_t arch_size = arch.fat_arch.size;
 		if(file_size != arch_size) {
-			fflush(file);
-			ftruncate(fd, arch_size);
-			file_size = arch_size;
+			truncate(arch_size);
 		}
 		return;
 	}
 
-	fseeko(file, sizeof(fat_header), SEEK_SET);
+	if(!IS_FAT_64(fat_magic) && needs_fat_64()) {
+		uint64_t table_end = sizeof(fat_header) + n_archs * sizeof(fat_arch_64);
+		for(auto &arch : archs) {
+			if(arch.fat_arch.offset < table_end) {
+				throw "No room for a 64-bit fat header before the first arch!";
+			}
+		}
+
+		// Same byte order as FAT_CIGAM, which dyld prefers
+		fat_magic = FAT_CIGAM_64;
+		write_fat_header();
+	}
+
+	off_t offset = sizeof(fat_header);
 	for(auto &arch : archs) {
-		fat_arch fat_arch = arch.fat_arch;
-		swap_arch(&fat_arch);
-		WRITE(fat_arch, file);
+		if(IS_FAT_64(fat_magic)) {
+			fat_arch_64 fat_arch = arch.fat_arch;
+			swap_arch(&fat_arch);
+
+			write_bytes(offset, &fat_arch, sizeof(fat_arch));
+			offset += sizeof(fat_arch);
+		} else {
+			fat_arch fat_arch = narrow_arch(arch.fat_arch);
+			write_bytes(offset, &fat_arch, sizeof(fat_arch));
+			offset += sizeof(fat_arch);
+		}
 	}
 
 	if(n_archs > 0) {
-		fat_arch &fat_arch = archs.back().fat_arch;
-		uint32_t new_size = fat_arch.offset + fat_arch.size;
+		fat_arch_64 &fat_arch = archs.back().fat_arch;
+		uint64_t new_size = fat_arch.offset + fat_arch.size;
 		if(new_size != file_size) {
-			fflush(file);
-			ftruncate(fd, new_size);
-
-			file_size = new_size;
+			truncate(new_size);
 		}
 	}
 }
 
-void MachO::write_mach_header(MachOArch &arch) const {
-	fseeko(file, arch.fat_arch.offset, SEEK_SET);
-	WRITE(arch.mach_header, file);
+void MachO::write_mach_header(MachOArch &arch) {
+	write_bytes(arch.fat_arch.offset, &arch.mach_header, sizeof(arch.mach_header));
 }
 
-void MachO::write_load_command(LoadCommand &lc) const {
-	fseeko(file, lc.file_offset, SEEK_SET);
-	fwrite(lc.raw_lc, lc.cmdsize, 1, file);
+void MachO::write_load_command(LoadCommand &lc) {
+	write_bytes(lc.file_offset, lc.raw_lc, lc.cmdsize);
 }
 
 void MachO::print_description() const {
@@ -146,68 +700,102 @@ void MachO::print_description() const {
 	}
 }
 
-fat_arch MachO::arch_from_mach_header(mach_header &mh, uint32_t size) const {
-	fat_arch arch;
+// Calls body for every index below n, on at most n_threads threads including
+// the calling one
+void MachO::parallel_for(size_t n, const std::function<void(size_t)> &body) const {
+	size_t n_workers = MAX((size_t)1, MIN((size_t)n_threads, n));
 
-	arch.offset = SWAP32(0, fat_magic);
-	arch.size = SWAP32(size, fat_magic);
+	auto worker = [&](size_t first) {
+		for(size_t i = first; i < n; i += n_workers) {
+			body(i);
+		}
+	};
 
-	cpu_type_t cputype = SWAP32(mh.cputype, mh.magic);
-	arch.cputype = SWAP32(cputype, fat_magic);
-	arch.cpusubtype = SWAP32(SWAP32(mh.cpusubtype, mh.magic), fat_magic);
+	std::vector<std::thread> threads;
+	for(size_t i = 1; i < n_workers; i++) {
+		threads.push_back(std::thread(worker, i));
+	}
+	worker(0);
 
-	uint32_t align = cpu_pagesize(cputype);
-	arch.align = SWAP32(align, fat_magic);
+	for(auto &thread : threads) {
+		thread.join();
+	}
+}
+
+fat_arch_64 MachO::arch_from_mach_header(mach_header &mh, uint64_t size) const {
+	fat_arch_64 arch;
+
+	arch.offset = 0;
+	arch.size = size;
+
+	arch.cputype = SWAP32(mh.cputype, mh.magic);
+	arch.cpusubtype = SWAP32(mh.cpusubtype, mh.magic);
+	arch.align = cpu_pagesize(arch.cputype);
+	arch.reserved = 0;
 
 	return arch;
 }
 
-void MachO::make_fat() {
+bool MachO::make_fat() {
 	assert(!is_fat);
 
 	MachOArch &arch = archs[0];
 
-	uint32_t offset = ROUND_UP(sizeof(fat_header), 1 << arch.fat_arch.align);
+	uint64_t offset = ROUND_UP(sizeof(fat_header), 1 << arch.fat_arch.align);
 
-	ftruncate(fd, file_size + offset);
+	if(!deferred) {
+		uint64_t size = file_size;
+		truncate(file_size + offset);
 
-	fmove(file, offset, 0, file_size);
-	fzero(file, offset, 0);
+		if(!fmove(file, offset, 0, size)) {
+			return false;
+		}
+		fzero(file, 0, offset);
+	}
 
 	// dyld doesn't like FAT_MAGIC
 	fat_magic = FAT_CIGAM;
+	is_fat = true;
 	write_fat_header();
 
-	arch.fat_arch.offset = offset;
+	arch.set_offset(offset);
+	if(!deferred) {
+		arch.set_source(file_ref);
+	}
 	write_fat_archs();
 
 	fflush(file);
 
-	is_fat = true;
-	file_size += offset;
+	return true;
 }
 
-void MachO::make_thin(uint32_t arch_index) {
+bool MachO::make_thin(uint32_t arch_index) {
 	assert(is_fat);
 
-	MachOArch &arch = archs[arch_index];
+	MachOArch arch = archs[arch_index];
 
-	archs = {arch};
+	uint64_t size = arch.fat_arch.size;
+	if(!deferred && !fmove(file, 0, arch.fat_arch.offset, size)) {
+		return false;
+	}
 
-	uint32_t size = arch.fat_arch.size;
-	fmove(file, 0, arch.fat_arch.offset, size);
+	arch.set_offset(0);
+	if(!deferred) {
+		arch.set_source(file_ref);
+	}
+	archs = {arch};
 
-	fflush(file);
-	ftruncate(fd, size);
+	truncate(size);
 
-	file_size = size;
 	n_archs = 1;
 	is_fat = false;
 
 	//swap_arch ????
+
+	return true;
 }
 
-bool MachO::save_arch_to_file(uint32_t arch_index, const char *filename) const {
+bool MachO::save_arch_to_file(uint32_t arch_index, const char *filename, bool *cloned) {
 	const MachOArch &arch = archs[arch_index];
 
 	FILE *f = fopen(filename, "w");
@@ -215,83 +803,295 @@ bool MachO::save_arch_to_file(uint32_t arch_index, const char *filename) const {
 		return false;
 	}
 
-	fcpy(f, 0, file, arch.fat_arch.offset, arch.fat_arch.size);
+	MachOArch thin = arch;
+	thin.set_offset(0);
+
+	bool ok = write_arch(f, 0, thin, cloned);
+
+	// Same permissions as the binary the arch comes from
+	struct stat s;
+	ok = ok && fstat(fileno(arch.source_file.get()), &s) == 0 && fchmod(fileno(f), s.st_mode & 07777) == 0;
+
+	ok = fclose(f) == 0 && ok;
+
+	return ok;
+}
+
+// Writes every arch to its own file, spread over n_threads threads
+std::vector<bool> MachO::save_archs_to_files(const std::vector<std::string> &filenames) {
+	std::vector<uint8_t> saved(n_archs);
+
+	parallel_for(n_archs, [&](size_t i) {
+		saved[i] = save_arch_to_file((uint32_t)i, filenames[i].c_str());
+	});
+
+	return std::vector<bool>(saved.begin(), saved.end());
+}
+
+std::string MachO::symbol_index_path() const {
+	return filename + ".symidx";
+}
+
+// Builds the symbol index of every arch, spread over n_threads threads
+void MachO::index_symbols() {
+	std::vector<std::shared_ptr<const SymbolIndex>> indices(n_archs);
+	std::vector<std::string> errors(n_archs);
+
+	parallel_for(n_archs, [&](size_t i) {
+		try {
+			indices[i].reset(new SymbolIndex(*this, (uint32_t)i));
+		} catch(const std::string &err) {
+			errors[i] = err;
+		} catch(const char *err) {
+			errors[i] = err;
+		}
+	});
+
+	for(uint32_t i = 0; i < n_archs; i++) {
+		if(!errors[i].empty()) {
+			throw archs[i].description() + ": " + errors[i];
+		}
+		archs[i].symbol_index = indices[i];
+	}
+}
+
+// Uses the symbol file next to the binary if it's still up to date
+bool MachO::load_symbol_index() {
+	// The file describes the binary on disk, not edits still to be written
+	if(!dirty_ranges.empty() || !zero_ranges.empty() || layout_changed()) {
+		return false;
+	}
+
+	struct stat s;
+	if(stat(filename.c_str(), &s) < 0) {
+		return false;
+	}
+
+	FILE *f = fopen(symbol_index_path().c_str(), "rb");
+	if(!f) {
+		return false;
+	}
+
+	symbol_index_header header;
+	bool ok = READ(header, f) == 1
+		&& header.magic == SYMBOL_INDEX_MAGIC
+		&& header.file_size == (uint64_t)s.st_size
+		&& header.mtime_sec == (int64_t)s.st_mtime
+		&& header.mtime_nsec == mtime_nsec(s)
+		&& header.n_archs == n_archs;
+
+	std::vector<std::shared_ptr<const SymbolIndex>> indices;
+	for(uint32_t i = 0; ok && i < n_archs; i++) {
+		std::shared_ptr<SymbolIndex> index(new SymbolIndex());
+		ok = index->read(f)
+			&& index->cputype == (uint32_t)archs[i].fat_arch.cputype
+			&& index->cpusubtype == (uint32_t)archs[i].fat_arch.cpusubtype;
+		indices.push_back(index);
+	}
 
 	fclose(f);
 
-	chmod(filename, S_IRWXU);
+	for(uint32_t i = 0; ok && i < n_archs; i++) {
+		archs[i].symbol_index = indices[i];
+	}
 
-	return true;
+	return ok;
 }
 
-void MachO::remove_arch(uint32_t arch_index) {
-	MachOArch &arch = archs[arch_index];
+bool MachO::save_symbol_index() const {
+	struct stat s;
+	if(stat(filename.c_str(), &s) < 0) {
+		return false;
+	}
 
-	fzero(file, arch.fat_arch.offset, arch.fat_arch.size);
+	for(auto &arch : archs) {
+		if(!arch.symbol_index) {
+			return false;
+		}
+	}
+
+	std::string path = symbol_index_path();
+	std::string tmp_name = path + ".XXXXXX";
+	int tmp_fd = mkstemp(&tmp_name[0]);
+	if(tmp_fd < 0) {
+		return false;
+	}
 
-	uint32_t new_offset;
-	if(arch_index == 0) {
-		new_offset = sizeof(fat_header);
+	FILE *f = fdopen(tmp_fd, "w");
+	if(!f) {
+		close(tmp_fd);
+		unlink(tmp_name.c_str());
+		return false;
+	}
+
+	fchmod(tmp_fd, 0644);
+
+	symbol_index_header header;
+	header.magic = SYMBOL_INDEX_MAGIC;
+	header.file_size = (uint64_t)s.st_size;
+	header.mtime_sec = (int64_t)s.st_mtime;
+	header.mtime_nsec = mtime_nsec(s);
+	header.n_archs = n_archs;
+	header.reserved = 0;
+
+	bool ok = WRITE(header, f) == 1;
+	for(uint32_t i = 0; ok && i < n_archs; i++) {
+		ok = archs[i].symbol_index->write(f);
+	}
+
+	ok = fclose(f) == 0 && ok;
+	ok = ok && rename(tmp_name.c_str(), path.c_str()) == 0;
+	if(!ok) {
+		unlink(tmp_name.c_str());
+	}
+
+	return ok;
+}
+
+// Offsets for archs[first..] packed one after another (respecting align)
+// behind archs[first - 1], or behind the fat archs if first is 0. Sets end
+// to the size of the file afterwards.
+std::vector<uint64_t> MachO::plan_compaction(uint32_t first, uint64_t *end) const {
+	uint64_t offset;
+	if(first == 0) {
+		offset = sizeof(fat_header) + n_archs * FAT_ARCH_SIZE(fat_magic);
 	} else {
-		fat_arch &prev_raw = archs[arch_index - 1].fat_arch;
-		new_offset = prev_raw.offset + prev_raw.size;
+		const fat_arch_64 &prev = archs[first - 1].fat_arch;
+		offset = prev.offset + prev.size;
 	}
 
-	archs.erase(archs.begin() + arch_index);
-	n_archs--;
+	std::vector<uint64_t> offsets;
+	for(uint32_t i = first; i < n_archs; i++) {
+		const fat_arch_64 &fat_arch = archs[i].fat_arch;
 
-	for(uint32_t i = arch_index; i < n_archs; i++) {
-		MachOArch &arch = archs[i];
+		offset = ROUND_UP(offset, 1 << fat_arch.align);
+		offsets.push_back(offset);
+		offset += fat_arch.size;
+	}
 
-		uint32_t offset = arch.fat_arch.offset;
-		uint32_t size =  arch.fat_arch.size;
+	*end = offset;
+	return offsets;
+}
+
+bool MachO::remove_arch(uint32_t arch_index) {
+	return remove_archs({arch_index});
+}
 
-		new_offset = ROUND_UP(new_offset, 1 << arch.fat_arch.align);
-		arch.fat_arch.offset = new_offset;
+bool MachO::remove_archs(std::vector<uint32_t> arch_indices) {
+	std::sort(arch_indices.begin(), arch_indices.end());
+	arch_indices.erase(std::unique(arch_indices.begin(), arch_indices.end()), arch_indices.end());
 
-		fmove(file, new_offset, offset, size);
-		fzero(file, new_offset + size, offset - new_offset);
+	if(arch_indices.empty()) {
+		return true;
+	}
+
+	uint32_t old_n_archs = n_archs;
+
+	for(auto it = arch_indices.rbegin(); it != arch_indices.rend(); it++) {
+		archs.erase(archs.begin() + *it);
+	}
+	n_archs = (uint32_t)archs.size();
 
-		new_offset += size;
+	uint32_t first = arch_indices[0];
+
+	uint64_t new_size;
+	std::vector<uint64_t> offsets = plan_compaction(first, &new_size);
+
+	// Moving the slices in place needs them in file order. A fat table that
+	// isn't is written out as a new file instead.
+	bool in_order = true;
+	for(uint32_t i = 1; i < n_archs; i++) {
+		const fat_arch_64 &prev = archs[i - 1].fat_arch;
+		in_order = in_order && archs[i].fat_arch.offset >= prev.offset + prev.size;
+	}
+	for(uint32_t i = first; i < n_archs; i++) {
+		in_order = in_order && offsets[i - first] <= archs[i].fat_arch.offset;
+	}
+
+	if(!deferred && !in_order) {
+		for(uint32_t i = first; i < n_archs; i++) {
+			archs[i].set_offset(offsets[i - first]);
+		}
+		return rewrite();
+	}
+
+	// Stale fat archs past the shorter table
+	uint64_t arch_size = FAT_ARCH_SIZE(fat_magic);
+	zero_bytes(sizeof(fat_header) + n_archs * arch_size, (old_n_archs - n_archs) * arch_size);
+
+	// Every slice only moves towards the start, so going front to back each
+	// one is moved once and never over a slice that hasn't moved yet
+	uint64_t gap_start;
+	if(first == 0) {
+		gap_start = sizeof(fat_header) + n_archs * arch_size;
+	} else {
+		const fat_arch_64 &prev = archs[first - 1].fat_arch;
+		gap_start = prev.offset + prev.size;
+	}
+
+	for(uint32_t i = first; i < n_archs; i++) {
+		MachOArch &arch = archs[i];
+		uint64_t new_offset = offsets[i - first];
+
+		if(!deferred) {
+			if(!fmove(file, new_offset, arch.fat_arch.offset, arch.fat_arch.size)) {
+				return false;
+			}
+			fzero(file, gap_start, new_offset - gap_start);
+		}
+
+		arch.set_offset(new_offset);
+		if(!deferred) {
+			arch.set_source(file_ref);
+		}
+
+		gap_start = new_offset + arch.fat_arch.size;
 	}
 
 	write_fat_header();
 	write_fat_archs();
 
-	fflush(file);
-	ftruncate(fd, new_offset);
+	truncate(new_size);
 
-	file_size = new_offset;
+	return true;
 }
 
-void MachO::insert_arch_from_macho(MachO &macho, uint32_t arch_index) {
+bool MachO::insert_arch_from_macho(MachO &macho, uint32_t arch_index, bool *cloned) {
 	n_archs++;
 
+	// Still reads its bytes from macho until it's written here
 	MachOArch arch = macho.archs[arch_index];
-	fat_arch &fat_arch = arch.fat_arch;
-
-	macho.swap_arch(&fat_arch);
-	swap_arch(&fat_arch);
+	fat_arch_64 &fat_arch = arch.fat_arch;
 
 	//arch.swap_mach_header(); ????
 
-	uint32_t offset = ROUND_UP(file_size, 1 << fat_arch.align);
+	uint64_t offset = ROUND_UP(file_size, 1 << fat_arch.align);
 
-	fat_arch.offset = offset;
+	arch.set_offset(offset);
 
 	archs.push_back(arch);
 
-	uint32_t new_size = file_size + offset;
+	uint64_t old_size = file_size;
+	truncate(offset + fat_arch.size);
 
-	ftruncate(fd, new_size);
-	fzero(file, file_size, offset - file_size);
+	if(cloned) {
+		*cloned = false;
+	}
 
-	fcpy(file, offset, macho.file, 0, fat_arch.size);
+	if(!deferred) {
+		fzero(file, old_size, offset - old_size);
 
-	file_size = new_size;
+		MachOArch &inserted = archs.back();
+		if(!write_arch(file, offset, inserted, cloned)) {
+			return false;
+		}
+		inserted.set_source(file_ref);
+	}
 
 	write_fat_header();
 	write_fat_archs();
+
+	return true;
 }
 
 void MachO::remove_load_command(uint32_t arch_index, uint32_t lc_index) {
@@ -309,9 +1109,12 @@ void MachO::remove_load_command(uint32_t arch_index, uint32_t lc_index) {
 
 	write_mach_header(arch);
 
-	fzero(file, lc.file_offset, lc.cmdsize);
+	zero_bytes(lc.file_offset, lc.cmdsize);
 
 	load_commands.pop_back();
+
+	// Removing a dylib shifts the ordinals of the ones after it
+	arch.symbol_index.reset();
 }
 
 void MachO::move_load_command(uint32_t arch_index, uint32_t lc_index, uint32_t new_index) {
@@ -328,41 +1131,45 @@ void MachO::move_load_command(uint32_t arch_index, uint32_t lc_index, uint32_t n
 	LoadCommand lc_to_move = load_commands[lc_index];
 
 	off_t new_offset = lc_to_move.file_offset;
-	fseeko(file, new_offset, SEEK_SET);
 
 	for(uint32_t i = lc_index + 1; i <= new_index; i++) {
 		LoadCommand &lc = load_commands[i];
 		lc.file_offset = new_offset;
 
-		fwrite(lc.raw_lc, lc.cmdsize, 1, file);
+		write_load_command(lc);
 
 		new_offset += lc.cmdsize;
 	}
 
 	lc_to_move.file_offset = new_offset;
-	fseeko(file, new_offset, SEEK_SET);
-	fwrite(lc_to_move.raw_lc, lc_to_move.cmdsize, 1, file);
+	write_load_command(lc_to_move);
 
 	load_commands.erase(load_commands.begin() + lc_index);
 	load_commands.push_back(lc_to_move);
+
+	// Library ordinals follow the order of the dylib commands
+	arch.symbol_index.reset();
 }
 
-void MachO::insert_load_command(uint32_t arch_index, load_command *raw_lc) {
+void MachO::insert_load_command(uint32_t arch_index, const load_command *raw_lc) {
 	MachOArch &arch = archs[arch_index];
 
-	uint32_t offset;
+	off_t offset;
 	if(arch.load_commands.size() == 0) {
-		offset = arch.fat_arch.offset + arch.fat_arch.size;
+		offset = arch.fat_arch.offset + MH_SIZE(arch.mach_header.magic);
 	} else {
 		LoadCommand &last_lc = arch.load_commands.back();
-		offset = (uint32_t)(last_lc.file_offset + last_lc.cmdsize);
+		offset = last_lc.file_offset + last_lc.cmdsize;
 	}
 
 	uint32_t magic = arch.mach_header.magic;
 	uint32_t cmdsize = SWAP32(raw_lc->cmdsize, magic);
 
-	fseeko(file, offset, SEEK_SET);
-	fwrite(raw_lc, cmdsize, 1, file);
+	if(MH_SIZE(magic) + arch.mach_header.sizeofcmds + cmdsize > arch.data_start()) {
+		throw "Not enough space for load command!";
+	}
+
+	write_bytes(offset, raw_lc, cmdsize);
 
 	arch.load_commands.push_back(LoadCommand(magic, offset, raw_lc));
 
@@ -381,6 +1188,70 @@ void MachO::change_file_type(uint32_t arch_index, uint32_t file_type) {
 }
 
 bool MachO::remove_codesignature(uint32_t arch_index) {
+	if(!strip_codesignature(arch_index)) {
+		return false;
+	}
+
+	write_fat_archs();
+
+	return true;
+}
+
+// Every arch is stripped on its own thread, they only write inside their
+// own slices. The fat archs are written once afterwards. The indices must be
+// distinct.
+std::vector<bool> MachO::remove_codesignatures(const std::vector<uint32_t> &arch_indices) {
+	std::vector<uint8_t> removed(arch_indices.size());
+
+	parallel_for(arch_indices.size(), [&](size_t i) {
+		removed[i] = strip_codesignature(arch_indices[i]);
+	});
+
+	write_fat_archs();
+
+	return std::vector<bool>(removed.begin(), removed.end());
+}
+
+// Writes a new export trie over the old one, which it has to fit in since
+// the rest of __LINKEDIT stays where it is. What's left of the old trie is
+// zeroed.
+void MachO::replace_export_trie(uint32_t arch_index, const std::vector<uint8_t> &trie) {
+	MachOArch &arch = archs[arch_index];
+	uint32_t magic = arch.mach_header.magic;
+
+	uint32_t offset;
+	uint32_t size;
+	uint32_t lc_index = arch.find_export_trie(offset, size);
+	if(lc_index == (uint32_t)-1) {
+		throw "No export trie!";
+	}
+
+	if(trie.size() > size) {
+		throw "New export trie is larger than the old one!";
+	}
+
+	std::vector<uint8_t> data(trie);
+	data.resize(size, 0);
+	write_arch_data(arch_index, offset, data.data(), size);
+
+	// Padded to pointer alignment like ld64 does
+	uint32_t new_size = MIN(ROUND_UP((uint32_t)trie.size(), IS_64_BIT(magic)? 8: 4), size);
+
+	LoadCommand &lc = arch.load_commands[lc_index];
+	if(lc.cmd == LC_DYLD_EXPORTS_TRIE) {
+		auto *c = (linkedit_data_command *)lc.mutable_lc();
+		c->datasize = SWAP32(new_size, magic);
+	} else {
+		auto *c = (dyld_info_command *)lc.mutable_lc();
+		c->export_size = SWAP32(new_size, magic);
+	}
+
+	write_load_command(lc);
+}
+
+// Everything remove_codesignature() does except writing the fat archs, so
+// it only touches the arch itself
+bool MachO::strip_codesignature(uint32_t arch_index) {
 	MachOArch &arch = archs[arch_index];
 	uint32_t magic = arch.mach_header.magic;
 
@@ -398,8 +1269,9 @@ bool MachO::remove_codesignature(uint32_t arch_index) {
 				break;
 			case LC_SEGMENT:
 			case LC_SEGMENT_64: {
-				auto *c = (segment_command *)&lc;
-				if(strncmp(c->segname, "__LINKEDIT", sizeof(c->segname))) {
+				// segname is at the same offset in segment_command_64
+				auto *c = (const segment_command *)lc.raw_lc;
+				if(strncmp(c->segname, "__LINKEDIT", sizeof(c->segname)) == 0) {
 					linkedit_lc = &lc;
 				}
 				break;
@@ -457,17 +1329,15 @@ bool MachO::remove_codesignature(uint32_t arch_index) {
 	uint64_t linkedit_vmsize = ROUND_UP(linkedit_size, 0x1000);
 
 	if(linkedit_lc->cmd == LC_SEGMENT) {
-		auto *c = (segment_command *)linkedit_lc->raw_lc;
+		auto *c = (segment_command *)linkedit_lc->mutable_lc();
 		c->filesize = SWAP32(linkedit_size, magic);
 		c->vmsize = SWAP32(linkedit_vmsize, magic);
 	} else {
-		auto *c = (segment_command_64 *)linkedit_lc->raw_lc;
+		auto *c = (segment_command_64 *)linkedit_lc->mutable_lc();
 		c->filesize = SWAP64(linkedit_size, magic);
 		c->vmsize = SWAP64(linkedit_vmsize, magic);
 	}
 
-	write_fat_archs();
-
 	write_load_command(*linkedit_lc);
 
 	remove_load_command(arch_index, codesig_index);
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -7,14 +10,20 @@
 #include <mach-o/loader.h>
 #include <stdio.h>
 
+#include "file_map.h"
 #include "macho_arch.h"
 
 class MachO {
 public:
 // Fields
+	std::string filename;
+
 	std::FILE *file;
+	std::shared_ptr<FILE> file_ref;
 	int fd;
-	uint32_t file_size;
+	uint64_t file_size;
+
+	std::shared_ptr<FileMap> map;
 
 	uint32_t fat_magic;
 
@@ -23,33 +32,87 @@ public:
 
 	std::vector<MachOArch> archs;
 
+	// Edits are only recorded while deferred and written by commit(). Arch
+	// operations then only change the layout, which commit() writes out as a
+	// new file.
+	bool deferred = false;
+	std::shared_ptr<std::mutex> edits_lock = std::make_shared<std::mutex>();
+	std::vector<std::pair<off_t, off_t>> dirty_ranges;
+	std::vector<std::pair<off_t, off_t>> zero_ranges;
+
+	// Threads work on the archs may be spread over. 1 when the binary is one
+	// of many that are edited at once, which already keeps every core busy.
+	unsigned int n_threads = 1;
+
 // Methods
 	MachO();
-	MachO(const char *filename);
+	MachO(const char *filename, bool writable_map = false, bool read_only = false);
+	MachO(const char *filename, std::shared_ptr<FileMap> map);
+	MachO(const char *filename, const std::vector<MachO> &inputs);
+
+	void parse();
+
+	void swap_arch(fat_arch_64 *arch) const;
+	fat_arch narrow_arch(const fat_arch_64 &arch) const;
+
+	void write_bytes(off_t offset, const void *ptr, size_t len);
+	void zero_bytes(off_t offset, size_t len);
+	void truncate(uint64_t new_size);
 
-	void swap_arch(fat_arch *arch) const;
+	void write_arch_data(uint32_t arch_index, uint64_t offset, const void *ptr, size_t len);
+	bool read_arch_data(uint32_t arch_index, uint64_t offset, void *buf, size_t len) const;
+	const uint8_t *arch_data(uint32_t arch_index, uint64_t offset, size_t len, std::shared_ptr<const void> &storage) const;
 
-	void write_fat_header() const;
+	void begin_edits();
+	void flush_edits();
+	bool commit();
+	void overlay_fat_table(uint8_t *buf, off_t start, off_t end) const;
+	void render(off_t offset, uint8_t *buf, size_t len) const;
+
+	bool layout_changed() const;
+	bool write_arch(FILE *out, off_t offset, const MachOArch &arch, bool *cloned = NULL) const;
+	bool write_to_file(FILE *out) const;
+	bool rewrite();
+
+	void layout_archs();
+	bool needs_fat_64() const;
+
+	void write_fat_header();
 	void write_fat_archs();
-	void write_mach_header(MachOArch &arch) const;
-	void write_load_command(LoadCommand &lc) const;
+	void write_mach_header(MachOArch &arch);
+	void write_load_command(LoadCommand &lc);
 
 	void print_description() const;
 
-	fat_arch arch_from_mach_header(mach_header &mach_header, uint32_t size) const;
+	void parallel_for(size_t n, const std::function<void(size_t)> &body) const;
+
+	fat_arch_64 arch_from_mach_header(mach_header &mach_header, uint64_t size) const;
 
-	void make_fat();
-	void make_thin(uint32_t arch_index);
+	bool make_fat();
+	bool make_thin(uint32_t arch_index);
 
-	bool save_arch_to_file(uint32_t arch_index, const char *filename) const;
-	void remove_arch(uint32_t arch_index);
-	void insert_arch_from_macho(MachO &macho, uint32_t arch_index);
+	bool save_arch_to_file(uint32_t arch_index, const char *filename, bool *cloned = NULL);
+	std::vector<bool> save_archs_to_files(const std::vector<std::string> &filenames);
+
+	std::string symbol_index_path() const;
+	void index_symbols();
+	bool load_symbol_index();
+	bool save_symbol_index() const;
+
+	std::vector<uint64_t> plan_compaction(uint32_t first, uint64_t *end) const;
+	bool remove_arch(uint32_t arch_index);
+	bool remove_archs(std::vector<uint32_t> arch_indices);
+	bool insert_arch_from_macho(MachO &macho, uint32_t arch_index, bool *cloned = NULL);
 
 	void remove_load_command(uint32_t arch_index, uint32_t lc_index);
 	void move_load_command(uint32_t arch_index, uint32_t lc_index, uint32_t new_index);
-	void insert_load_command(uint32_t arch_index, load_command *raw_lc);
+	void insert_load_command(uint32_t arch_index, const load_command *raw_lc);
     
     void change_file_type(uint32_t arch_index, uint32_t file_type);
 
 	bool remove_codesignature(uint32_t arch_index);
+	std::vector<bool> remove_codesignatures(const std::vector<uint32_t> &arch_indices);
+	bool strip_codesignature(uint32_t arch_index);
+
+	void replace_export_trie(uint32_t arch_index, const std::vector<uint8_t> &trie);
 };
@@ -1,32 +1,61 @@
 #include <iostream>
 #include <sstream>
 
+#include <string.h>
+
 #include "cpuinfo.h"
-#include "fileutils.h"
 #include "macho_arch.h"
 #include "macros.h"
+#include "symbol_index.h"
 
 MachOArch::MachOArch() {
 }
 
-MachOArch::MachOArch(struct fat_arch *fat_arch, FILE *f) {
-	off_t original_offset = ftello(f);
-
+MachOArch::MachOArch(struct fat_arch_64 *fat_arch, const FileMap &map) {
 	this->fat_arch = *fat_arch;
 
-	fseeko(f, fat_arch->offset, SEEK_SET);
-	PEEK(mach_header, f);
+	auto *mh = (struct mach_header *)map.at(fat_arch->offset, sizeof(mach_header));
+	if(!mh) {
+		throw "Mach header extends past end of file!";
+	}
+
+	mach_header = *mh;
 
 	uint32_t mh_magic = mach_header.magic;
 
 	swap_mach_header(&mach_header);
 
-	fseeko(f, MH_SIZE(mh_magic), SEEK_CUR);
-	for(size_t i = 0; i < mach_header.ncmds; i++) {
-		load_commands.push_back(LoadCommand(mh_magic, f));
+	off_t offset = fat_arch->offset + MH_SIZE(mh_magic);
+	uint32_t sizeofcmds = mach_header.sizeofcmds;
+	cmds_extent = sizeofcmds;
+
+	auto *cmds = (uint8_t *)map.at(offset, sizeofcmds);
+	if(!cmds) {
+		throw "Load commands extend past end of file!";
 	}
 
-	fseeko(f, original_offset, SEEK_SET);
+	// One copy of the whole command area that all the load commands point into,
+	// so later in-place edits of the file don't change them under our feet
+	std::shared_ptr<uint8_t> image(new uint8_t[sizeofcmds], std::default_delete<uint8_t[]>());
+	memcpy(image.get(), cmds, sizeofcmds);
+
+	uint32_t pos = 0;
+	load_commands.reserve(mach_header.ncmds);
+	for(size_t i = 0; i < mach_header.ncmds; i++) {
+		if(sizeofcmds - pos < sizeof(load_command)) {
+			throw "Load command extends past sizeofcmds!";
+		}
+
+		auto *lc = (load_command *)(image.get() + pos);
+		uint32_t cmdsize = SWAP32(lc->cmdsize, mh_magic);
+		if(cmdsize < sizeof(load_command) || cmdsize > sizeofcmds - pos) {
+			throw "Load command extends past sizeofcmds!";
+		}
+
+		load_commands.push_back(LoadCommand(mh_magic, offset + pos, lc, image));
+
+		pos += cmdsize;
+	}
 }
 
 void MachOArch::swap_mach_header(struct mach_header *mh) const {
@@ -38,6 +67,23 @@ void MachOArch::swap_mach_header(struct mach_header *mh) const {
 	}
 }
 
+void MachOArch::set_offset(uint64_t offset) {
+	for(auto &lc : load_commands) {
+		lc.file_offset += (off_t)offset - (off_t)fat_arch.offset;
+	}
+
+	fat_arch.offset = offset;
+}
+
+void MachOArch::set_source(std::shared_ptr<FILE> file) {
+	source_file = file;
+	source_offset = fat_arch.offset;
+}
+
+bool MachOArch::is_in_place(FILE *file) const {
+	return source_file.get() == file && source_offset == fat_arch.offset;
+}
+
 std::string MachOArch::description() const {
 	std::string name = cpu_name(fat_arch.cputype, fat_arch.cpusubtype);
 
@@ -55,10 +101,141 @@ void MachOArch::print_load_commands() const {
 }
 
 bool MachOArch::has_codesignature() const {
+	return has_load_command(LC_CODE_SIGNATURE);
+}
+
+bool MachOArch::has_load_command(uint32_t cmd) const {
 	for(auto &lc : load_commands) {
-		if(lc.cmd == LC_CODE_SIGNATURE) {
+		if(lc.cmd == cmd) {
 			return true;
 		}
 	}
 	return false;
 }
+
+// Where the first segment or section data after the load commands is in the
+// slice, so the commands can't grow past it
+uint64_t MachOArch::data_start() const {
+	uint32_t magic = mach_header.magic;
+	uint64_t start = fat_arch.size;
+
+	for(auto &lc : load_commands) {
+		if(lc.cmd == LC_SEGMENT_64 && lc.cmdsize >= sizeof(segment_command_64)) {
+			auto *c = (const segment_command_64 *)lc.raw_lc;
+			uint64_t fileoff = SWAP64(c->fileoff, magic);
+			if(fileoff && SWAP64(c->filesize, magic)) {
+				start = MIN(start, fileoff);
+			}
+
+			auto *sects = (const section_64 *)(c + 1);
+			uint32_t nsects = MIN(SWAP32(c->nsects, magic), (uint32_t)((lc.cmdsize - sizeof(*c)) / sizeof(*sects)));
+			for(uint32_t i = 0; i < nsects; i++) {
+				uint32_t offset = SWAP32(sects[i].offset, magic);
+				if(offset) {
+					start = MIN(start, offset);
+				}
+			}
+		} else if(lc.cmd == LC_SEGMENT && lc.cmdsize >= sizeof(segment_command)) {
+			auto *c = (const segment_command *)lc.raw_lc;
+			uint32_t fileoff = SWAP32(c->fileoff, magic);
+			if(fileoff && SWAP32(c->filesize, magic)) {
+				start = MIN(start, fileoff);
+			}
+
+			auto *sects = (const section *)(c + 1);
+			uint32_t nsects = MIN(SWAP32(c->nsects, magic), (uint32_t)((lc.cmdsize - sizeof(*c)) / sizeof(*sects)));
+			for(uint32_t i = 0; i < nsects; i++) {
+				uint32_t offset = SWAP32(sects[i].offset, magic);
+				if(offset) {
+					start = MIN(start, offset);
+				}
+			}
+		}
+	}
+
+	return start;
+}
+
+// Whether the slice defines or imports name, and where
+bool MachOArch::find_symbol(const std::string &name, symbol_location &location) const {
+	if(!symbol_index) {
+		throw "Symbols aren't indexed!";
+	}
+	return symbol_index->find(name, location);
+}
+
+// The index of the command that has the export trie and where the trie is
+// in the slice, or -1 if there's none
+uint32_t MachOArch::find_export_trie(uint32_t &offset, uint32_t &size) const {
+	uint32_t magic = mach_header.magic;
+	uint32_t found = -1;
+
+	for(uint32_t i = 0; i < load_commands.size(); i++) {
+		const LoadCommand &lc = load_commands[i];
+		switch(lc.cmd) {
+			case LC_DYLD_INFO:
+			case LC_DYLD_INFO_ONLY: {
+				if(lc.cmdsize < sizeof(dyld_info_command) || found != (uint32_t)-1) {
+					break;
+				}
+
+				auto *c = (const dyld_info_command *)lc.raw_lc;
+				if(c->export_size) {
+					offset = SWAP32(c->export_off, magic);
+					size = SWAP32(c->export_size, magic);
+					found = i;
+				}
+				break;
+			}
+			case LC_DYLD_EXPORTS_TRIE: {
+				if(lc.cmdsize < sizeof(linkedit_data_command)) {
+					break;
+				}
+
+				auto *c = (const linkedit_data_command *)lc.raw_lc;
+				offset = SWAP32(c->dataoff, magic);
+				size = SWAP32(c->datasize, magic);
+				return i;
+			}
+		}
+	}
+
+	return found;
+}
+
+// The paths of the dylibs that library ordinals count, in order
+std::vector<std::string> MachOArch::dylib_paths() const {
+	std::vector<std::string> paths;
+	for(auto &lc : load_commands) {
+		std::string path;
+		switch(lc.cmd) {
+			case LC_LOAD_DYLIB:
+			case LC_LOAD_WEAK_DYLIB:
+			case LC_REEXPORT_DYLIB:
+			case LC_LAZY_LOAD_DYLIB:
+			case LC_LOAD_UPWARD_DYLIB:
+				paths.push_back(lc.get_path(path)? path: "?");
+				break;
+		}
+	}
+	return paths;
+}
+
+std::string library_name(const std::vector<std::string> &dylib_paths, int32_t lib_ordinal) {
+	switch(lib_ordinal) {
+		case BIND_SPECIAL_DYLIB_SELF:
+			return "self";
+		case BIND_SPECIAL_DYLIB_MAIN_EXECUTABLE:
+			return "main-executable";
+		case BIND_SPECIAL_DYLIB_FLAT_LOOKUP:
+			return "flat-namespace";
+		case BIND_SPECIAL_DYLIB_WEAK_LOOKUP:
+			return "weak";
+	}
+
+	if(lib_ordinal > 0 && (size_t)lib_ordinal <= dylib_paths.size()) {
+		return dylib_paths[lib_ordinal - 1];
+	}
+
+	return "ordinal " + std::to_string(lib_ordinal);
+}
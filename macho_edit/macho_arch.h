@@ -1,27 +1,63 @@
 #pragma once
 
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <mach-o/fat.h>
 #include <mach-o/loader.h>
+#include <stdio.h>
 
+#include "file_map.h"
 #include "load_command.h"
 
+class SymbolIndex;
+struct symbol_location;
+
+std::string library_name(const std::vector<std::string> &dylib_paths, int32_t lib_ordinal);
+
 class MachOArch {
 public:
 // Fields
-	fat_arch fat_arch;
+	fat_arch_64 fat_arch;
 	mach_header mach_header;
 	std::vector<LoadCommand> load_commands;
 
+	// Where the slice's bytes currently are, which only differs from fat_arch
+	// while a deferred relayout hasn't been written out
+	std::shared_ptr<FILE> source_file;
+	uint64_t source_offset = 0;
+
+	// Bytes after the mach header that have held load commands, whatever the
+	// current ones don't cover is zeroed when the slice is written out
+	uint32_t cmds_extent = 0;
+
+	// Data of the slice replaced while edits are deferred, by offset from the
+	// start of the slice, written over the source bytes when the slice is
+	std::vector<std::pair<uint64_t, std::shared_ptr<const std::vector<uint8_t>>>> patches;
+
+	// Set by MachO::index_symbols() or load_symbol_index()
+	std::shared_ptr<const SymbolIndex> symbol_index;
+
 // Methods
 	MachOArch();
-	MachOArch(struct fat_arch *fat_arch, FILE *f);
+	MachOArch(struct fat_arch_64 *fat_arch, const FileMap &map);
 
 	void swap_mach_header(struct mach_header *mh) const;
+	void set_offset(uint64_t offset);
+	void set_source(std::shared_ptr<FILE> file);
+	bool is_in_place(FILE *file) const;
 
 	std::string description() const;
 	void print_load_commands() const;
 
 	bool has_codesignature() const;
+	bool has_load_command(uint32_t cmd) const;
+	uint64_t data_start() const;
+	uint32_t find_export_trie(uint32_t &offset, uint32_t &size) const;
+
+	std::vector<std::string> dylib_paths() const;
+
+	bool find_symbol(const std::string &name, symbol_location &location) const;
 };
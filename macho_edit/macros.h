@@ -6,14 +6,21 @@
 
 #define ELEMENTS(x) (sizeof(x) / sizeof(*(x)))
 
-#define IS_FAT(x) ((x) == FAT_MAGIC || (x) == FAT_CIGAM)
+#define IS_FAT(x) ((x) == FAT_MAGIC || (x) == FAT_CIGAM || (x) == FAT_MAGIC_64 || (x) == FAT_CIGAM_64)
+#define IS_FAT_64(x) ((x) == FAT_MAGIC_64 || (x) == FAT_CIGAM_64)
 #define IS_THIN(x) ((x) == MH_MAGIC || (x) == MH_CIGAM || (x) == MH_MAGIC_64 || (x) == MH_CIGAM_64)
 #define IS_MAGIC(x) (IS_FAT(x) || IS_THIN(x))
+// Java class files start with FAT_MAGIC too and have their version where
+// nfat_arch is, which like file(1) tells them apart from fat binaries
+#define MAX_FAT_ARCHS 45
+#define IS_MACHO(magic, nfat_arch) (IS_THIN(magic) || (IS_FAT(magic) && SWAP32(nfat_arch, magic) < MAX_FAT_ARCHS))
 #define IS_64_BIT(x) ((x) == MH_MAGIC_64 || (x) == MH_CIGAM_64)
-#define IS_BIG_ENDIAN(x) ((x) == FAT_CIGAM || (x) == MH_CIGAM_64 || (x) == MH_CIGAM)
+#define IS_BIG_ENDIAN(x) ((x) == FAT_CIGAM || (x) == FAT_CIGAM_64 || (x) == MH_CIGAM_64 || (x) == MH_CIGAM)
+#define SWAP16(x, magic) (IS_BIG_ENDIAN(magic)? OSSwapInt16(x): (x))
 #define SWAP32(x, magic) (IS_BIG_ENDIAN(magic)? OSSwapInt32((uint32_t)x): ((uint32_t)x))
 #define SWAP64(x, magic) (IS_BIG_ENDIAN(magic)? OSSwapInt64(x): (x))
 #define MH_SIZE(magic) (IS_64_BIT(magic)? sizeof(mach_header_64): sizeof(mach_header))
+#define FAT_ARCH_SIZE(magic) (IS_FAT_64(magic)? sizeof(fat_arch_64): sizeof(fat_arch))
 
 #define ROUND_UP(x, y) (((x) + (y) - 1) & -(y))
 
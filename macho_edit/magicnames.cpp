@@ -13,6 +13,8 @@ std::string magic_name(uint32_t magic) {
 	switch(magic) {
 		RET_NAME(FAT_MAGIC);
 		RET_NAME(FAT_CIGAM);
+		RET_NAME(FAT_MAGIC_64);
+		RET_NAME(FAT_CIGAM_64);
 		RET_NAME(MH_MAGIC);
 		RET_NAME(MH_MAGIC_64);
 		RET_NAME(MH_CIGAM);
@@ -73,6 +75,8 @@ std::string cmd_name(uint32_t cmd) {
 			RET_NAME(LC_ENCRYPTION_INFO_64);
 			RET_NAME(LC_LINKER_OPTION);
 			RET_NAME(LC_LINKER_OPTIMIZATION_HINT);
+			RET_NAME(LC_DYLD_EXPORTS_TRIE);
+			RET_NAME(LC_DYLD_CHAINED_FIXUPS);
 	}
 
 	std::ostringstream o;
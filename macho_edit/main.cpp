@@ -1,26 +1,137 @@
 #include <iostream>
+#include <memory>
+#include <thread>
 
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "commands.h"
+#include "index_query.h"
+#include "load_command_index.h"
 #include "menu.h"
 
 __attribute__((noreturn)) void usage(void) {
 	std::cout << "Usage: macho_edit binary_path\n";
+	std::cout << "       macho_edit [-j jobs] [-c cache] command [args] [command [args]]... [--] path...\n";
+	std::cout << "       macho_edit -c cache --invalidate [path]...\n";
+	std::cout << "       macho_edit [-j jobs] [-c cache] --index|--append-index index path...\n";
+	std::cout << "       macho_edit --create output input...\n";
+	std::cout << "       macho_edit [-j jobs] --explode path...\n";
+	std::cout << "       macho_edit --query index [arch <arch>] has|lacks <cmd|*> [<path>|<prefix>*]\n\n";
+	std::cout << "Directories are searched for mach-o binaries. Read only commands keep the\n";
+	std::cout << "headers of every file in the cache and skip files that haven't changed.\n\n";
+
+	print_commands_usage();
 
 	exit(1);
 }
 
 int main(int argc, const char *argv[]) {
-	if(argc != 2) {
+	if(argc < 2) {
 		usage();
 	}
 
-	const char *binary_path = argv[1];
+	if(argc == 2 && !is_command(argv[1])) {
+		const char *binary_path = argv[1];
+
+		MachO macho = MachO(binary_path);
+		macho.n_threads = std::thread::hardware_concurrency();
 
-	MachO macho = MachO(binary_path);
+		macho.print_description();
+
+		while(main_menu(macho)) {
+		}
+
+		return 0;
+	}
+
+	int arg = 1;
+
+	unsigned int n_threads = std::thread::hardware_concurrency();
+	const char *cache_path = NULL;
+	while(arg + 1 < argc) {
+		if(!strcmp(argv[arg], "-j")) {
+			if(atoi(argv[arg + 1]) <= 0) {
+				usage();
+			}
+			n_threads = atoi(argv[arg + 1]);
+		} else if(!strcmp(argv[arg], "-c")) {
+			cache_path = argv[arg + 1];
+		} else {
+			break;
+		}
+		arg += 2;
+	}
+
+	std::unique_ptr<ParseCache> cache;
+	if(cache_path) {
+		cache.reset(new ParseCache(cache_path));
+		if(!cache->load()) {
+			std::cout << "Ignoring corrupt cache " << cache_path << "\n";
+		}
+	}
 
-	macho.print_description();
+	bool ok;
+	if(arg < argc && !strcmp(argv[arg], "--invalidate")) {
+		if(!cache) {
+			usage();
+		}
+
+		invalidate_cache(*cache, std::vector<std::string>(argv + arg + 1, argv + argc));
+		ok = true;
+	} else if(arg < argc && !strcmp(argv[arg], "--create")) {
+		if(argc - arg < 3) {
+			usage();
+		}
+
+		ok = create_fat(argv[arg + 1], std::vector<std::string>(argv + arg + 2, argv + argc));
+	} else if(arg < argc && !strcmp(argv[arg], "--explode")) {
+		if(argc - arg < 2) {
+			usage();
+		}
+
+		ok = explode_binaries(std::vector<std::string>(argv + arg + 1, argv + argc), n_threads);
+	} else if(arg < argc && !strcmp(argv[arg], "--query")) {
+		if(argc - arg < 2) {
+			usage();
+		}
+
+		ok = run_query(argv[arg + 1], argc - arg - 2, argv + arg + 2);
+	} else if(arg < argc && (!strcmp(argv[arg], "--index") || !strcmp(argv[arg], "--append-index"))) {
+		if(argc - arg < 3) {
+			usage();
+		}
+
+		const char *index_path = argv[arg + 1];
+
+		LoadCommandIndex index;
+		if(!strcmp(argv[arg], "--append-index") && !index.read(index_path)) {
+			std::cout << "Couldn't read index " << index_path << "\n";
+			return 1;
+		}
+
+		ok = index.scan(std::vector<std::string>(argv + arg + 2, argv + argc), n_threads, cache.get());
+		index.remove_replaced_files();
+
+		if(!index.write(index_path)) {
+			std::cout << "Couldn't write index " << index_path << "\n";
+			ok = false;
+		}
+	} else {
+		std::vector<Command> commands;
+		std::vector<std::string> paths;
+		if(!parse_commands(argc - arg, argv + arg, commands, paths)) {
+			usage();
+		}
+
+		ok = run_batch(commands, paths, n_threads, cache.get());
+	}
 
-	while(main_menu(macho)) {
+	if(cache && !cache->save()) {
+		std::cout << "Couldn't save cache " << cache_path << "\n";
+		ok = false;
 	}
 
-    return 0;
+	return ok? 0: 1;
 }
@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 
+#include "commands.h"
 #include "macros.h"
 #include "magicnames.h"
 #include "menu.h"
@@ -138,7 +139,10 @@ bool fat_config(MachO &macho) {
 
 		switch(select_option("", thin_options)) {
 			case 0: {
-				macho.make_fat();
+				macho.begin_edits();
+				if(!macho.make_fat() || !macho.commit()) {
+					std::cout << "Failed to write binary!\n";
+				}
 				break;
 			}
 			case 1:
@@ -168,7 +172,10 @@ bool fat_config(MachO &macho) {
 					}
 				}
 
-				macho.make_thin(thin_arch);
+				macho.begin_edits();
+				if(!macho.make_thin(thin_arch) || !macho.commit()) {
+					std::cout << "Failed to write binary!\n";
+				}
 
 				break;
 			}
@@ -187,8 +194,9 @@ bool fat_config(MachO &macho) {
 				std::string path;
 				readline(path);
 
-				if(macho.save_arch_to_file(arch, path.c_str())) {
-					std::cout << "Arch successfully extracted.\n";
+				bool cloned;
+				if(macho.save_arch_to_file(arch, path.c_str(), &cloned)) {
+					std::cout << "Arch successfully extracted" << (cloned? " (cloned).\n": " (copied, cloning not supported).\n");
 				} else {
 					std::cout << "Failed to extract arch!\n";
 				}
@@ -206,7 +214,10 @@ bool fat_config(MachO &macho) {
 					break;
 				}
 
-				macho.remove_arch(arch);
+				macho.begin_edits();
+				if(!macho.remove_arch(arch) || !macho.commit()) {
+					std::cout << "Failed to write binary!\n";
+				}
 
 				break;
 			}
@@ -245,7 +256,14 @@ bool fat_config(MachO &macho) {
 				uint32_t last = insert_arch == ALL? macho_in.n_archs - 1: insert_arch;
 
 				for(uint32_t i = first; i <= last; i++) {
-					macho.insert_arch_from_macho(macho_in, i);
+					bool cloned;
+					if(!macho.insert_arch_from_macho(macho_in, i, &cloned)) {
+						std::cout << "Failed to insert arch " << i << "!\n";
+						break;
+					}
+					if(!cloned) {
+						std::cout << "Arch " << i << " was copied, cloning not supported.\n";
+					}
 				}
 
 				break;
@@ -272,31 +290,6 @@ bool ask_for_path(const char *prompt, std::string &path) {
 	return true;
 }
 
-#define PATH_PADDING 8
-
-load_command *get_path_cmd(const char *prompt, size_t header_size, uint32_t *cmdsize) {
-	std::string path;
-	if(!ask_for_path(prompt, path)) {
-		return NULL;
-	}
-
-	uint32_t path_size = (uint32_t)ROUND_UP(path.length() + 1, PATH_PADDING);
-	*cmdsize = (uint32_t)header_size + path_size;
-
-	load_command *lc = (load_command *)malloc(*cmdsize);
-	memcpy(((uint8_t *)lc) + header_size, path.c_str(), path.length());
-	return lc;
-}
-
-load_command *create_lc_id_dylib(const std::string id, size_t header_size, uint32_t *cmdsize) {
-    uint32_t path_size = (uint32_t)ROUND_UP(id.length() + 1, PATH_PADDING);
-    *cmdsize = (uint32_t)header_size + path_size;
-
-    load_command *lc = (load_command *)malloc(*cmdsize);
-    memcpy(((uint8_t *)lc) + header_size, id.c_str(), id.length());
-    return lc;
-}
-
 void lc_insert(MachO &macho, uint32_t arch) {
 	static uint32_t insertable_cmds[] = {
         LC_ID_DYLIB,
@@ -322,57 +315,32 @@ void lc_insert(MachO &macho, uint32_t arch) {
 
 	uint32_t magic = macho.archs[arch].mach_header.magic;
 
-	load_command *lc = NULL;
-
+	std::string path;
 	switch(cmd) {
-        case LC_ID_DYLIB: {
-            uint32_t cmdsize;
-            if((lc = create_lc_id_dylib("test_path", sizeof(dylib_command), &cmdsize))) {
-                auto *c = (dylib_command *)lc;
-                c->cmd = SWAP32(cmd, magic);
-                c->cmdsize = SWAP32(cmdsize, magic);
-                c->dylib = {
-                    .name.offset = SWAP32(sizeof(dylib_command), magic),
-                    .timestamp = 0,
-                    .current_version = 0,
-                    .compatibility_version = 0
-                };
-            }
-            
-            break;
-        }
+		case LC_ID_DYLIB:
+			path = "test_path";
+			break;
 		case LC_LOAD_DYLIB:
-		case LC_LOAD_WEAK_DYLIB: {
-			uint32_t cmdsize;
-			if((lc = get_path_cmd("Dylib path:", sizeof(dylib_command), &cmdsize))) {
-				auto *c = (dylib_command *)lc;
-				c->cmd = SWAP32(cmd, magic);
-				c->cmdsize = SWAP32(cmdsize, magic);
-				c->dylib = {
-					.name.offset = SWAP32(sizeof(dylib_command), magic),
-					.timestamp = 0,
-					.current_version = 0,
-					.compatibility_version = 0
-				};
+		case LC_LOAD_WEAK_DYLIB:
+			if(!ask_for_path("Dylib path:", path)) {
+				return;
 			}
-
 			break;
-		}
-		case LC_RPATH: {
-			uint32_t cmdsize;
-			if((lc = get_path_cmd("Runpath:", sizeof(dylib_command), &cmdsize))) {
-				auto *c = (rpath_command *)lc;
-				c->cmd = SWAP32(cmd, magic);
-				c->cmdsize = SWAP32(cmdsize, magic);
-				c->path.offset = SWAP32(sizeof(dylib_command), magic);
+		case LC_RPATH:
+			if(!ask_for_path("Runpath:", path)) {
+				return;
 			}
-
 			break;
-		}
 	}
 
+	load_command *lc = create_path_cmd(cmd, magic, path);
+
 	if(lc) {
-		macho.insert_load_command(arch, lc);
+		try {
+			macho.insert_load_command(arch, lc);
+		} catch(const char *err) {
+			std::cout << err << "\n";
+		}
 		free(lc);
 	}
 }
@@ -431,15 +399,28 @@ bool lc_config(MachO &macho) {
 			break;
 		}
 		case 4: {
+			macho.begin_edits();
+
+			std::vector<uint32_t> signed_archs;
 			for(uint32_t i = first; i <= last; i++) {
 				if(!macho.archs[i].has_codesignature()) {
 					std::cout << "Arch " << i << " doesn't have a codesignature.\n";
 					continue;
 				}
-				macho.remove_codesignature(i);
-				std::cout << "Removed codesignature from arch " << i << ".\n";
+				signed_archs.push_back(i);
 			}
 
+			std::vector<bool> removed = macho.remove_codesignatures(signed_archs);
+			for(size_t i = 0; i < signed_archs.size(); i++) {
+				if(removed[i]) {
+					std::cout << "Removed codesignature from arch " << signed_archs[i] << ".\n";
+				} else {
+					std::cout << "Couldn't remove codesignature from arch " << signed_archs[i] << ".\n";
+				}
+			}
+
+			macho.commit();
+
 			break;
 		}
 	}
@@ -458,29 +439,22 @@ bool main_menu(MachO &macho) {
         return false;
     }
     
-    uint32_t cmd = LC_ID_DYLIB;
-
-    load_command *lc = NULL;
-    
-    uint32_t cmdsize;
-    if((lc = create_lc_id_dylib("test_path", sizeof(dylib_command), &cmdsize))) {
-        auto *c = (dylib_command *)lc;
-        c->cmd = SWAP32(cmd, magic);
-        c->cmdsize = SWAP32(cmdsize, magic);
-        c->dylib = {
-            .name.offset = SWAP32(sizeof(dylib_command), magic),
-            .timestamp = 0,
-            .current_version = 0,
-            .compatibility_version = 0
-        };
-    }
+    load_command *lc = create_path_cmd(LC_ID_DYLIB, magic, "test_path");
     
+    macho.begin_edits();
+
     if(lc) {
-        macho.insert_load_command(arch, lc);
+        try {
+            macho.insert_load_command(arch, lc);
+        } catch(const char *err) {
+            std::cout << err << "\n";
+        }
         free(lc);
     }
     
     macho.change_file_type(arch, MH_DYLIB);
+
+    macho.commit();
     
     return false;
 }
@@ -0,0 +1,296 @@
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fileutils.h"
+#include "macros.h"
+#include "parse_cache.h"
+
+#define CACHE_MAGIC 0x316568636163656dULL // "mecache1"
+
+// Sanity limit so a corrupt cache can't make us allocate gigabytes
+#define MAX_CHUNK_SIZE 0x1000000
+
+struct cache_record {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t n_chunks;
+};
+
+struct cache_chunk {
+	uint64_t offset;
+	uint64_t len;
+};
+
+static ParseCache::key key_of(const struct stat &s) {
+	ParseCache::key k;
+	k.dev = (uint64_t)s.st_dev;
+	k.ino = (uint64_t)s.st_ino;
+	return k;
+}
+
+// Copies only what the parser looks at out of the pages HeaderLoader read:
+// the magic, the fat archs and every mach header with its load commands.
+// Returns NULL if something isn't there, the whole map is kept then.
+static std::shared_ptr<FileMap> header_bytes(const FileMap &map) {
+	auto headers = std::make_shared<FileMap>(map.size);
+
+	auto copy = [&](off_t offset, size_t len) {
+		if(offset < 0 || (size_t)offset >= map.size) {
+			return true;
+		}
+
+		len = MIN(len, map.size - (size_t)offset);
+		auto *ptr = (const uint8_t *)map.at(offset, len);
+		if(!ptr) {
+			return false;
+		}
+
+		headers->add(offset, std::vector<uint8_t>(ptr, ptr + len));
+		return true;
+	};
+
+	auto copy_arch = [&](off_t offset) {
+		auto *mh = (const mach_header *)map.at(offset, sizeof(mach_header));
+		if(!mh || !IS_THIN(mh->magic)) {
+			return copy(offset, sizeof(uint32_t));
+		}
+
+		size_t mh_size = MH_SIZE(mh->magic);
+		if(!map.at(offset, mh_size)) {
+			return false;
+		}
+
+		size_t cmds_len = MIN((size_t)SWAP32(mh->sizeofcmds, mh->magic), map.size - (size_t)offset - mh_size);
+		auto *cmds = (const uint8_t *)map.at(offset + mh_size, cmds_len);
+		if(cmds_len && !cmds) {
+			return false;
+		}
+
+		// The commands may have been read separately from the header
+		std::vector<uint8_t> bytes((const uint8_t *)mh, (const uint8_t *)mh + mh_size);
+		if(cmds_len) {
+			bytes.insert(bytes.end(), cmds, cmds + cmds_len);
+		}
+
+		headers->add(offset, std::move(bytes));
+		return true;
+	};
+
+	auto *magic = (const uint32_t *)map.at(0, sizeof(uint32_t));
+	if(!magic) {
+		return headers;
+	}
+
+	if(!IS_FAT(*magic)) {
+		return copy_arch(0)? headers: NULL;
+	}
+
+	auto *fh = (const fat_header *)map.at(0, sizeof(fat_header));
+	if(!fh) {
+		return NULL;
+	}
+
+	uint32_t n_archs = SWAP32(fh->nfat_arch, *magic);
+	size_t arch_size = FAT_ARCH_SIZE(*magic);
+	auto *raw_archs = (const uint8_t *)map.at(sizeof(fat_header), n_archs * arch_size);
+	if(!raw_archs || !copy(0, sizeof(fat_header) + n_archs * arch_size)) {
+		return NULL;
+	}
+
+	for(uint32_t i = 0; i < n_archs; i++) {
+		off_t offset;
+		if(IS_FAT_64(*magic)) {
+			offset = (off_t)SWAP64(((const fat_arch_64 *)raw_archs)[i].offset, *magic);
+		} else {
+			offset = (off_t)SWAP32(((const fat_arch *)raw_archs)[i].offset, *magic);
+		}
+
+		if(offset > 0 && (size_t)offset < map.size && !copy_arch(offset)) {
+			return NULL;
+		}
+	}
+
+	return headers;
+}
+
+ParseCache::ParseCache(const std::string &path) : hits(0), misses(0) {
+	this->path = path;
+}
+
+// A missing cache is just empty. A corrupt one is dropped entirely and
+// replaced on the next save.
+bool ParseCache::load() {
+	FILE *f = fopen(path.c_str(), "r");
+	if(!f) {
+		return true;
+	}
+
+	std::unordered_map<key, entry, key_hash> loaded;
+
+	uint64_t magic = 0;
+	uint64_t n_entries = 0;
+	bool ok = READ(magic, f) == 1 && magic == CACHE_MAGIC && READ(n_entries, f) == 1;
+
+	for(uint64_t i = 0; ok && i < n_entries; i++) {
+		cache_record record;
+		if(READ(record, f) != 1) {
+			ok = false;
+			break;
+		}
+
+		auto map = std::make_shared<FileMap>((size_t)record.size);
+		for(uint64_t j = 0; ok && j < record.n_chunks; j++) {
+			cache_chunk chunk;
+			ok = READ(chunk, f) == 1 && chunk.len <= MAX_CHUNK_SIZE;
+			if(!ok) {
+				break;
+			}
+
+			std::vector<uint8_t> bytes((size_t)chunk.len);
+			ok = fread(bytes.data(), 1, bytes.size(), f) == bytes.size();
+			map->add((off_t)chunk.offset, std::move(bytes));
+		}
+
+		key k;
+		k.dev = record.dev;
+		k.ino = record.ino;
+
+		entry &e = loaded[k];
+		e.size = record.size;
+		e.mtime_sec = record.mtime_sec;
+		e.mtime_nsec = record.mtime_nsec;
+		e.map = map;
+	}
+
+	fclose(f);
+
+	std::lock_guard<std::mutex> guard(lock);
+	if(ok) {
+		entries = std::move(loaded);
+	} else {
+		entries.clear();
+		dirty = true;
+	}
+
+	return ok;
+}
+
+// Written to a temporary file first so concurrent runs never read half a cache
+bool ParseCache::save() {
+	std::lock_guard<std::mutex> guard(lock);
+	if(!dirty) {
+		return true;
+	}
+
+	std::string tmp_name = path + ".XXXXXX";
+	int tmp_fd = mkstemp(&tmp_name[0]);
+	if(tmp_fd < 0) {
+		return false;
+	}
+
+	FILE *f = fdopen(tmp_fd, "w");
+	if(!f) {
+		close(tmp_fd);
+		unlink(tmp_name.c_str());
+		return false;
+	}
+
+	uint64_t magic = CACHE_MAGIC;
+	uint64_t n_entries = entries.size();
+	bool ok = WRITE(magic, f) == 1 && WRITE(n_entries, f) == 1;
+
+	for(auto &it : entries) {
+		if(!ok) {
+			break;
+		}
+
+		const entry &e = it.second;
+
+		cache_record record;
+		record.dev = it.first.dev;
+		record.ino = it.first.ino;
+		record.size = e.size;
+		record.mtime_sec = e.mtime_sec;
+		record.mtime_nsec = e.mtime_nsec;
+		record.n_chunks = e.map->chunks.size();
+		ok = WRITE(record, f) == 1;
+
+		for(auto &c : e.map->chunks) {
+			cache_chunk chunk;
+			chunk.offset = (uint64_t)c.first;
+			chunk.len = c.second.size();
+
+			ok = ok && WRITE(chunk, f) == 1 && fwrite(c.second.data(), 1, c.second.size(), f) == c.second.size();
+		}
+	}
+
+	ok = fclose(f) == 0 && ok;
+	ok = ok && rename(tmp_name.c_str(), path.c_str()) == 0;
+	if(!ok) {
+		unlink(tmp_name.c_str());
+		return false;
+	}
+
+	dirty = false;
+	return true;
+}
+
+std::shared_ptr<FileMap> ParseCache::find(const struct stat &s) {
+	std::lock_guard<std::mutex> guard(lock);
+
+	auto it = entries.find(key_of(s));
+	if(it == entries.end() || it->second.size != (uint64_t)s.st_size || it->second.mtime_sec != (int64_t)s.st_mtime || it->second.mtime_nsec != mtime_nsec(s)) {
+		misses++;
+		return NULL;
+	}
+
+	hits++;
+	return it->second.map;
+}
+
+// Of files that aren't mach-o binaries only the magic and the word after it
+// are kept, which is enough to reject them again
+void ParseCache::insert(const struct stat &s, std::shared_ptr<FileMap> map) {
+	auto *magic = (uint32_t *)map->at(0, 2 * sizeof(uint32_t));
+	if(!magic || !IS_MACHO(magic[0], magic[1])) {
+		auto trimmed = std::make_shared<FileMap>(map->size);
+		if(magic) {
+			trimmed->add(0, std::vector<uint8_t>((uint8_t *)magic, (uint8_t *)(magic + 2)));
+		}
+		map = trimmed;
+	} else if(auto headers = header_bytes(*map)) {
+		map = headers;
+	}
+
+	entry e;
+	e.size = (uint64_t)s.st_size;
+	e.mtime_sec = (int64_t)s.st_mtime;
+	e.mtime_nsec = mtime_nsec(s);
+	e.map = map;
+
+	std::lock_guard<std::mutex> guard(lock);
+	entries[key_of(s)] = e;
+	dirty = true;
+}
+
+void ParseCache::erase(const std::string &file) {
+	struct stat s;
+	if(stat(file.c_str(), &s) != 0) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> guard(lock);
+	dirty = entries.erase(key_of(s)) > 0 || dirty;
+}
+
+void ParseCache::clear() {
+	std::lock_guard<std::mutex> guard(lock);
+	entries.clear();
+	dirty = true;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "file_map.h"
+
+// Keeps the header chunks HeaderLoader read from every file in a file on
+// disk, so files that haven't changed since are parsed without opening them.
+// Entries are found by device and inode and are only used while the size and
+// modification time still match.
+class ParseCache {
+public:
+	struct key {
+		uint64_t dev;
+		uint64_t ino;
+
+		bool operator==(const key &other) const {
+			return dev == other.dev && ino == other.ino;
+		}
+	};
+
+	struct key_hash {
+		size_t operator()(const key &k) const {
+			return std::hash<uint64_t>()(k.dev * 31 + k.ino);
+		}
+	};
+
+	struct entry {
+		uint64_t size;
+		int64_t mtime_sec;
+		int64_t mtime_nsec;
+
+		std::shared_ptr<FileMap> map;
+	};
+
+// Fields
+	std::string path;
+
+	std::mutex lock;
+	std::unordered_map<key, entry, key_hash> entries;
+	bool dirty = false;
+
+	std::atomic<size_t> hits;
+	std::atomic<size_t> misses;
+
+// Methods
+	ParseCache(const std::string &path);
+
+	bool load();
+	bool save();
+
+	std::shared_ptr<FileMap> find(const struct stat &s);
+	void insert(const struct stat &s, std::shared_ptr<FileMap> map);
+
+	void erase(const std::string &file);
+	void clear();
+};
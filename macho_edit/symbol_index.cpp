@@ -0,0 +1,248 @@
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <string.h>
+
+#include "macros.h"
+#include "symbol_index.h"
+
+// Sanity limit so a corrupt symbol file can't make us allocate gigabytes
+#define MAX_SYMBOL_INDEX_SIZE 0x40000000
+
+// FNV-1a
+uint32_t symbol_hash(const char *name, size_t len) {
+	uint32_t hash = 2166136261u;
+	for(size_t i = 0; i < len; i++) {
+		hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+SymbolIndex::SymbolIndex() {
+}
+
+SymbolIndex::SymbolIndex(const MachO &macho, uint32_t arch_index) {
+	const MachOArch &arch = macho.archs[arch_index];
+
+	cputype = (uint32_t)arch.fat_arch.cputype;
+	cpusubtype = (uint32_t)arch.fat_arch.cpusubtype;
+
+	SymbolTable table(macho, arch_index);
+
+	for(auto &name : table.sections) {
+		sections.push_back(add_string(name.c_str(), name.length()));
+	}
+
+	const dysymtab_command *dysymtab = NULL;
+	for(auto &lc : arch.load_commands) {
+		if(lc.cmd == LC_DYSYMTAB && lc.cmdsize >= sizeof(dysymtab_command)) {
+			dysymtab = (const dysymtab_command *)lc.raw_lc;
+		}
+	}
+
+	// Library ordinals only mean something with two level namespaces
+	if(arch.mach_header.flags & MH_TWOLEVEL) {
+		for(auto &path : arch.dylib_paths()) {
+			libraries.push_back(add_string(path.c_str(), path.length()));
+		}
+	}
+
+	// The defined external symbols come before the undefined ones, so a name
+	// that's both is found as defined
+	if(dysymtab) {
+		uint32_t ranges[][2] = {
+			{SWAP32(dysymtab->iextdefsym, table.magic), SWAP32(dysymtab->nextdefsym, table.magic)},
+			{SWAP32(dysymtab->iundefsym, table.magic), SWAP32(dysymtab->nundefsym, table.magic)}
+		};
+
+		for(size_t i = 0; i < ELEMENTS(ranges); i++) {
+			uint32_t start = MIN(ranges[i][0], table.n_symbols);
+			uint32_t end = start + MIN(ranges[i][1], table.n_symbols - start);
+
+			for(uint32_t j = start; j < end; j++) {
+				add_symbol(table.at(j));
+			}
+		}
+	} else {
+		for(uint32_t i = 0; i < table.n_symbols; i++) {
+			symbol sym = table.at(i);
+			if((sym.type & N_TYPE) != N_UNDF) {
+				add_symbol(sym);
+			}
+		}
+		for(uint32_t i = 0; i < table.n_symbols; i++) {
+			symbol sym = table.at(i);
+			if((sym.type & N_TYPE) == N_UNDF) {
+				add_symbol(sym);
+			}
+		}
+	}
+
+	build_slots();
+}
+
+uint32_t SymbolIndex::add_string(const char *str, size_t len) {
+	uint32_t offset = (uint32_t)strings.size();
+	strings.insert(strings.end(), str, str + len);
+	strings.push_back('\0');
+	return offset;
+}
+
+void SymbolIndex::add_symbol(const symbol &sym) {
+	if((sym.type & N_STAB) || !(sym.type & N_EXT) || sym.name_len == 0) {
+		return;
+	}
+
+	symbol_index_entry entry;
+	entry.name = add_string(sym.name, sym.name_len);
+	entry.name_len = sym.name_len;
+	entry.hash = symbol_hash(sym.name, sym.name_len);
+	entry.type = sym.type;
+	entry.sect = sym.sect;
+	entry.desc = sym.desc;
+	entry.value = sym.value;
+
+	entries.push_back(entry);
+}
+
+// Linear probing, the first entry with a name wins
+void SymbolIndex::build_slots() {
+	size_t n_slots = 1;
+	while(n_slots < entries.size() * 2) {
+		n_slots *= 2;
+	}
+
+	slots.assign(n_slots, SYMBOL_INDEX_EMPTY);
+
+	for(uint32_t i = 0; i < entries.size(); i++) {
+		const symbol_index_entry &entry = entries[i];
+		if(find(&strings[entry.name], entry.name_len)) {
+			continue;
+		}
+
+		size_t slot = entry.hash & (n_slots - 1);
+		while(slots[slot] != SYMBOL_INDEX_EMPTY) {
+			slot = (slot + 1) & (n_slots - 1);
+		}
+		slots[slot] = i;
+	}
+}
+
+const symbol_index_entry *SymbolIndex::find(const char *name, size_t len) const {
+	if(slots.empty()) {
+		return NULL;
+	}
+
+	uint32_t hash = symbol_hash(name, len);
+
+	size_t mask = slots.size() - 1;
+	for(size_t slot = hash & mask; slots[slot] != SYMBOL_INDEX_EMPTY; slot = (slot + 1) & mask) {
+		const symbol_index_entry &entry = entries[slots[slot]];
+		if(entry.hash == hash && entry.name_len == len && !memcmp(&strings[entry.name], name, len)) {
+			return &entry;
+		}
+	}
+
+	return NULL;
+}
+
+bool SymbolIndex::find(const std::string &name, symbol_location &location) const {
+	const symbol_index_entry *entry = find(name.c_str(), name.length());
+	if(!entry) {
+		return false;
+	}
+
+	uint8_t type = entry->type & N_TYPE;
+
+	location.defined = type != N_UNDF && type != N_PBUD;
+	location.weak = (entry->desc & (location.defined? N_WEAK_DEF: N_WEAK_REF)) != 0;
+	location.value = entry->value;
+	location.section.clear();
+	location.library.clear();
+
+	if(type == N_SECT && entry->sect > 0 && entry->sect <= sections.size()) {
+		location.section = &strings[sections[entry->sect - 1]];
+	}
+
+	uint32_t ordinal = GET_LIBRARY_ORDINAL(entry->desc);
+	if(!location.defined && ordinal > 0 && ordinal <= libraries.size()) {
+		location.library = &strings[libraries[ordinal - 1]];
+	}
+
+	return true;
+}
+
+// Everything find() relies on is checked, so a corrupt file can't make it
+// read outside the index
+bool SymbolIndex::read(FILE *f) {
+	symbol_index_arch header;
+	if(READ(header, f) != 1) {
+		return false;
+	}
+
+	uint64_t size = (uint64_t)header.n_entries * sizeof(symbol_index_entry)
+		+ ((uint64_t)header.n_slots + header.n_sections + header.n_libraries) * sizeof(uint32_t)
+		+ header.strings_size;
+	if(size > MAX_SYMBOL_INDEX_SIZE || (header.n_slots & (header.n_slots - 1)) || header.n_slots < header.n_entries) {
+		return false;
+	}
+
+	SymbolIndex index;
+	index.cputype = header.cputype;
+	index.cpusubtype = header.cpusubtype;
+	index.entries.resize(header.n_entries);
+	index.slots.resize(header.n_slots);
+	index.sections.resize(header.n_sections);
+	index.libraries.resize(header.n_libraries);
+	index.strings.resize(header.strings_size);
+
+	bool ok = fread(index.entries.data(), sizeof(symbol_index_entry), header.n_entries, f) == header.n_entries;
+	ok = ok && fread(index.slots.data(), sizeof(uint32_t), header.n_slots, f) == header.n_slots;
+	ok = ok && fread(index.sections.data(), sizeof(uint32_t), header.n_sections, f) == header.n_sections;
+	ok = ok && fread(index.libraries.data(), sizeof(uint32_t), header.n_libraries, f) == header.n_libraries;
+	ok = ok && fread(index.strings.data(), 1, header.strings_size, f) == header.strings_size;
+	ok = ok && (header.strings_size == 0 || index.strings.back() == '\0');
+
+	bool has_empty = header.n_slots == 0;
+	for(size_t i = 0; ok && i < index.slots.size(); i++) {
+		has_empty = has_empty || index.slots[i] == SYMBOL_INDEX_EMPTY;
+		ok = index.slots[i] == SYMBOL_INDEX_EMPTY || index.slots[i] < header.n_entries;
+	}
+	ok = ok && has_empty;
+
+	for(size_t i = 0; ok && i < index.entries.size(); i++) {
+		ok = (uint64_t)index.entries[i].name + index.entries[i].name_len < header.strings_size;
+	}
+	for(size_t i = 0; ok && i < index.sections.size(); i++) {
+		ok = index.sections[i] < header.strings_size;
+	}
+	for(size_t i = 0; ok && i < index.libraries.size(); i++) {
+		ok = index.libraries[i] < header.strings_size;
+	}
+
+	if(ok) {
+		*this = index;
+	}
+
+	return ok;
+}
+
+bool SymbolIndex::write(FILE *f) const {
+	symbol_index_arch header;
+	header.cputype = cputype;
+	header.cpusubtype = cpusubtype;
+	header.n_entries = (uint32_t)entries.size();
+	header.n_slots = (uint32_t)slots.size();
+	header.n_sections = (uint32_t)sections.size();
+	header.n_libraries = (uint32_t)libraries.size();
+	header.strings_size = (uint32_t)strings.size();
+	header.reserved = 0;
+
+	bool ok = WRITE(header, f) == 1;
+	ok = ok && fwrite(entries.data(), sizeof(symbol_index_entry), entries.size(), f) == entries.size();
+	ok = ok && fwrite(slots.data(), sizeof(uint32_t), slots.size(), f) == slots.size();
+	ok = ok && fwrite(sections.data(), sizeof(uint32_t), sections.size(), f) == sections.size();
+	ok = ok && fwrite(libraries.data(), sizeof(uint32_t), libraries.size(), f) == libraries.size();
+	ok = ok && fwrite(strings.data(), 1, strings.size(), f) == strings.size();
+
+	return ok;
+}
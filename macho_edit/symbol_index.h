@@ -0,0 +1,101 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "symbol_table.h"
+
+#define SYMBOL_INDEX_MAGIC 0x3178696d7973656dULL // "mesymix1"
+
+#define SYMBOL_INDEX_EMPTY 0xffffffff
+
+// A symbol file, <binary>.symidx, starts with this header and holds the
+// index of every arch in order. It's only used while the binary's size and
+// modification time still match.
+struct symbol_index_header {
+	uint64_t magic;
+	uint64_t file_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t n_archs;
+	uint32_t reserved;
+};
+
+// Each arch's index is this header followed by its entries, slots,
+// sections, libraries and string pool
+struct symbol_index_arch {
+	uint32_t cputype;
+	uint32_t cpusubtype;
+	uint32_t n_entries;
+	uint32_t n_slots;
+	uint32_t n_sections;
+	uint32_t n_libraries;
+	uint32_t strings_size;
+	uint32_t reserved;
+};
+
+struct symbol_index_entry {
+	uint32_t name;
+	uint32_t name_len;
+	uint32_t hash;
+
+	uint8_t type;
+	uint8_t sect;
+	uint16_t desc;
+	uint64_t value;
+};
+
+uint32_t symbol_hash(const char *name, size_t len);
+
+// What a slice has to say about a symbol it defines or imports
+struct symbol_location {
+	bool defined;
+	bool weak;
+
+	// "segname,sectname" of a defined symbol, empty if it's absolute
+	std::string section;
+	uint64_t value;
+
+	// The library an import is bound to, empty for flat namespace lookups
+	std::string library;
+};
+
+// The external symbols of an arch, the ones it defines and the ones it
+// imports, in an open addressing hash table so a lookup costs a probe or two
+// instead of a pass over the symbol table. Names are copied into the index,
+// so it answers without the binary and can be written out as is.
+class SymbolIndex {
+public:
+// Fields
+	uint32_t cputype = 0;
+	uint32_t cpusubtype = 0;
+
+	std::vector<symbol_index_entry> entries;
+
+	// Indices into entries, at most half full and a power of two long
+	std::vector<uint32_t> slots;
+
+	// String offsets of section names by section number starting at 1, and of
+	// the dylibs by library ordinal starting at 1
+	std::vector<uint32_t> sections;
+	std::vector<uint32_t> libraries;
+
+	std::vector<char> strings;
+
+// Methods
+	SymbolIndex();
+	SymbolIndex(const MachO &macho, uint32_t arch_index);
+
+	uint32_t add_string(const char *str, size_t len);
+	void add_symbol(const symbol &sym);
+	void build_slots();
+
+	const symbol_index_entry *find(const char *name, size_t len) const;
+	bool find(const std::string &name, symbol_location &location) const;
+
+	bool read(FILE *f);
+	bool write(FILE *f) const;
+};
@@ -0,0 +1,211 @@
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "macros.h"
+#include "symbol_table.h"
+
+#define SWAR_ONES 0x0101010101010101ULL
+#define SWAR_LOW7 0x7f7f7f7f7f7f7f7fULL
+
+SymbolTable::SymbolTable(const MachO &macho, uint32_t arch_index) {
+	const MachOArch &arch = macho.archs[arch_index];
+
+	magic = arch.mach_header.magic;
+
+	const symtab_command *symtab = NULL;
+	for(auto &lc : arch.load_commands) {
+		switch(lc.cmd) {
+			case LC_SYMTAB:
+				if(lc.cmdsize >= sizeof(symtab_command)) {
+					symtab = (const symtab_command *)lc.raw_lc;
+				}
+				break;
+			case LC_SEGMENT: {
+				if(lc.cmdsize < sizeof(segment_command)) {
+					break;
+				}
+
+				auto *c = (const segment_command *)lc.raw_lc;
+				auto *sects = (const section *)(c + 1);
+
+				for(uint32_t i = 0; i < SWAP32(c->nsects, magic) && (uint8_t *)(sects + i + 1) <= (uint8_t *)c + lc.cmdsize; i++) {
+					sections.push_back(std::string(sects[i].segname, strnlen(sects[i].segname, 16)) + "," + std::string(sects[i].sectname, strnlen(sects[i].sectname, 16)));
+				}
+				break;
+			}
+			case LC_SEGMENT_64: {
+				if(lc.cmdsize < sizeof(segment_command_64)) {
+					break;
+				}
+
+				auto *c = (const segment_command_64 *)lc.raw_lc;
+				auto *sects = (const section_64 *)(c + 1);
+
+				for(uint32_t i = 0; i < SWAP32(c->nsects, magic) && (uint8_t *)(sects + i + 1) <= (uint8_t *)c + lc.cmdsize; i++) {
+					sections.push_back(std::string(sects[i].segname, strnlen(sects[i].segname, 16)) + "," + std::string(sects[i].sectname, strnlen(sects[i].sectname, 16)));
+				}
+				break;
+			}
+		}
+	}
+
+	if(!symtab) {
+		throw "No LC_SYMTAB!";
+	}
+
+	n_symbols = SWAP32(symtab->nsyms, magic);
+	strings_size = SWAP32(symtab->strsize, magic);
+
+	size_t nlist_size = IS_64_BIT(magic)? sizeof(nlist_64): sizeof(nlist);
+	if(n_symbols) {
+		symbols = macho.arch_data(arch_index, SWAP32(symtab->symoff, magic), n_symbols * nlist_size, symbols_storage);
+	}
+	if(strings_size) {
+		strings = (const char *)macho.arch_data(arch_index, SWAP32(symtab->stroff, magic), strings_size, strings_storage);
+	}
+
+	if((!symbols && n_symbols) || (!strings && strings_size)) {
+		throw "Symbol table extends past end of arch!";
+	}
+}
+
+symbol SymbolTable::at(uint32_t index) const {
+	symbol sym;
+	uint32_t strx;
+
+	if(IS_64_BIT(magic)) {
+		auto *n = (const nlist_64 *)symbols + index;
+		strx = SWAP32(n->n_un.n_strx, magic);
+		sym.type = n->n_type;
+		sym.sect = n->n_sect;
+		sym.desc = SWAP16(n->n_desc, magic);
+		sym.value = SWAP64(n->n_value, magic);
+	} else {
+		auto *n = (const nlist *)symbols + index;
+		strx = SWAP32(n->n_un.n_strx, magic);
+		sym.type = n->n_type;
+		sym.sect = n->n_sect;
+		sym.desc = SWAP16((uint16_t)n->n_desc, magic);
+		sym.value = SWAP32(n->n_value, magic);
+	}
+
+	if(strx < strings_size) {
+		sym.name = strings + strx;
+		sym.name_len = name_length(strx);
+	} else {
+		sym.name = "";
+		sym.name_len = 0;
+	}
+
+	return sym;
+}
+
+// Looks at eight bytes at a time: a byte of y has its top bit set exactly
+// when that byte of x is zero, without the false positives of the shorter
+// (x - 1) & ~x trick. Names are usually short, so this beats a memchr per
+// name.
+void SymbolTable::index_names() {
+	name_ends.clear();
+
+	uint32_t i = 0;
+	for(; i + sizeof(uint64_t) <= strings_size; i += sizeof(uint64_t)) {
+		uint64_t x;
+		memcpy(&x, strings + i, sizeof(x));
+
+		uint64_t y = ~(((x & SWAR_LOW7) + SWAR_LOW7) | x | SWAR_LOW7);
+
+		// The tables are read on little endian hosts, the lowest byte comes first
+		while(y) {
+			name_ends.push_back(i + __builtin_ctzll(y) / 8);
+			y &= y - 1;
+		}
+	}
+
+	for(; i < strings_size; i++) {
+		if(strings[i] == '\0') {
+			name_ends.push_back(i);
+		}
+	}
+}
+
+uint32_t SymbolTable::name_length(uint32_t strx) const {
+	if(name_ends.empty()) {
+		return (uint32_t)strnlen(strings + strx, strings_size - strx);
+	}
+
+	// Names may be the tail of another, so strx isn't always at a start
+	auto end = std::lower_bound(name_ends.begin(), name_ends.end(), strx);
+	return end == name_ends.end()? strings_size - strx: *end - strx;
+}
+
+// The letter nm shows, lowercase for symbols that aren't external
+char SymbolTable::type_letter(const symbol &sym) const {
+	char letter;
+	switch(sym.type & N_TYPE) {
+		case N_UNDF:
+			letter = sym.value? 'C': 'U';
+			break;
+		case N_ABS:
+			letter = 'A';
+			break;
+		case N_INDR:
+			letter = 'I';
+			break;
+		case N_PBUD:
+			letter = 'U';
+			break;
+		case N_SECT: {
+			const std::string *name = sym.sect > 0 && sym.sect <= sections.size()? &sections[sym.sect - 1]: NULL;
+			if(name && *name == "__TEXT,__text") {
+				letter = 'T';
+			} else if(name && *name == "__DATA,__data") {
+				letter = 'D';
+			} else if(name && *name == "__DATA,__bss") {
+				letter = 'B';
+			} else {
+				letter = 'S';
+			}
+			break;
+		}
+		default:
+			letter = '?';
+			break;
+	}
+
+	return (sym.type & N_EXT)? letter: (char)tolower(letter);
+}
+
+// Like nm: value, letter and name of every symbol but the debugging ones
+void SymbolTable::print(std::ostream &out) const {
+	int width = IS_64_BIT(magic)? 16: 8;
+
+	std::string buf;
+	char line[32];
+
+	for(uint32_t i = 0; i < n_symbols; i++) {
+		symbol sym = at(i);
+		if(sym.type & N_STAB) {
+			continue;
+		}
+
+		char letter = type_letter(sym);
+		if(letter == 'U' || letter == 'u') {
+			snprintf(line, sizeof(line), "%*s %c ", width, "", letter);
+		} else {
+			snprintf(line, sizeof(line), "%0*llx %c ", width, (unsigned long long)sym.value, letter);
+		}
+
+		buf += line;
+		buf.append(sym.name, sym.name_len);
+		buf += '\n';
+
+		if(buf.size() > 0x10000) {
+			out << buf;
+			buf.clear();
+		}
+	}
+
+	out << buf;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <mach-o/nlist.h>
+#include <stdint.h>
+
+#include "macho.h"
+
+// An nlist or nlist_64 entry in host byte order
+struct symbol {
+	const char *name;
+	uint32_t name_len;
+
+	uint8_t type;
+	uint8_t sect;
+	uint16_t desc;
+	uint64_t value;
+};
+
+// The LC_SYMTAB symbols of an arch, read from the mapped file (or a copy of
+// the edited arch) as they're asked for. index_names() finds where every name ends in a single pass
+// over the string table, after which name lengths don't need a scan.
+class SymbolTable {
+public:
+// Fields
+	uint32_t magic;
+
+	const uint8_t *symbols = NULL;
+	uint32_t n_symbols = 0;
+
+	const char *strings = NULL;
+	uint32_t strings_size = 0;
+
+	// The mapped file or copies of the tables
+	std::shared_ptr<const void> symbols_storage;
+	std::shared_ptr<const void> strings_storage;
+
+	// Offsets of all NULs in the string table
+	std::vector<uint32_t> name_ends;
+
+	// "segname,sectname" by section number, starting at 1
+	std::vector<std::string> sections;
+
+// Methods
+	SymbolTable(const MachO &macho, uint32_t arch_index);
+
+	symbol at(uint32_t index) const;
+
+	void index_names();
+	uint32_t name_length(uint32_t strx) const;
+
+	char type_letter(const symbol &sym) const;
+	void print(std::ostream &out) const;
+};